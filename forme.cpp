@@ -1,8 +1,50 @@
-#include <unistd.h>     // sbrk
+#include <unistd.h>     // sbrk, write, close
 #include <sys/mman.h>   // mmap, munmap
+#include <fcntl.h>      // open
+#include <sys/stat.h>   // fstat
+#include <pthread.h>    // process-shared robust mutexes (shared heaps)
+#include <cerrno>       // errno
+#include <cstdio>       // snprintf, vsnprintf
+#include <cstdarg>      // va_list
+#include <ctime>        // clock_gettime
+#include <thread>       // std::thread (stats sampler, free reclaimer, fill workers)
+#include <condition_variable>
 #include <cstring>      // memset, memmove
 #include <cmath>        // pow
 #include <iostream>     // std::cerr, std::cout
+#include <atomic>       // std::atomic
+#include <mutex>        // std::mutex, std::lock_guard
+#include <cstdint>      // uint64_t, uintptr_t
+#include <new>          // placement new
+
+#if defined(__linux__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>     // struct rseq, __rseq_offset, __rseq_size
+#include <sys/syscall.h>  // __NR_rseq
+#define SMALLOC_HAVE_RSEQ 1
+#endif
+
+// USDT probes (provider "smalloc") for perf/bpftrace; each one is a single nop
+// until a tracer attaches. Without <sys/sdt.h>, or with SMALLOC_NO_PROBES
+// defined, they compile to nothing.
+#if __has_include(<sys/sdt.h>) && !defined(SMALLOC_NO_PROBES)
+#include <sys/sdt.h>
+#define SMALLOC_PROBE2(name, a, b)    DTRACE_PROBE2(smalloc, name, a, b)
+#define SMALLOC_PROBE3(name, a, b, c) DTRACE_PROBE3(smalloc, name, a, b, c)
+#else
+#define SMALLOC_PROBE2(name, a, b)    do { } while (0)
+#define SMALLOC_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#ifdef SMALLOC_PERF_COUNTERS
+#include <linux/perf_event.h>  // perf_event_attr (benchmark counters)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>      // std::coroutine_handle (sasync_alloc)
+#define SMALLOC_HAVE_COROUTINES 1
+#endif
 
 // --------------------------------------------------------------------------------
 // Constants
@@ -10,7 +52,13 @@
 static const int    MAX_ORDER      = 10;          // orders 0..10 => 128..128K
 static const size_t BLOCK_SIZE     = 128 * 1024;  // 128KB
 static const int    NUM_INIT_BLOCKS= 32;          // 32 blocks => 4MB
-static bool         buddy_initialized = false;
+static const size_t MIN_BLOCK_SIZE = 128;         // size of an order-0 block
+static const int    RING_ORDER     = -2;          // mmapList kind: double-mapped ring
+static const int    FILE_ORDER     = -3;          // mmapList kind: smap_file mapping
+static const int    COW_ORDER      = -4;          // mmapList kind: memfd-backed, see sclone
+static const int    IO_ORDER       = -5;          // mmapList kind: large sio_alloc buffer
+static const int    TLSF_ORDER     = -6;          // region block owned by the TLSF engine
+static std::atomic<bool> buddy_initialized(false);
 
 // We'll store the base of the entire 4MB region
 static char* BASE = nullptr;
@@ -20,13 +68,20 @@ static char* BASE = nullptr;
 //   - .size   : total size of this block (including metadata!)
 //   - .is_free: whether block is free
 //   - .is_mmap: whether allocated via mmap
+//   - .tag    : allocation tag of a used block (0 = untagged), fills padding
 //   - .order  : if buddy block, order=0..10, else -1 for mmap
+//               (RING_ORDER for a double-mapped sring_alloc block,
+//               FILE_ORDER for an out-of-band smap_file header,
+//               COW_ORDER for a memfd-backed block not cloned yet,
+//               IO_ORDER for a large page-aligned sio_alloc buffer,
+//               TLSF_ORDER for a block of the TLSF engine)
 //   - .next/.prev: doubly linked pointers in a free list
 // --------------------------------------------------------------------------------
 struct MallocMetadata {
     size_t size;      // total size of block including this metadata
     bool   is_free;
     bool   is_mmap;
+    uint16_t tag;
     int    order;
 
     MallocMetadata* next;
@@ -147,16 +202,37 @@ static BlocksList buddyArray[MAX_ORDER + 1];
 // We'll keep a separate list for mmap blocks
 static BlocksList mmapList;
 
+// One lock per buddyArray order, so allocations of different orders don't
+// serialize. Whenever several are held they were taken in ascending order.
+// The small-block caches sit in front of these and only lock on a miss/flush.
+struct alignas(64) OrderLock {
+    std::mutex m;
+};
+static OrderLock  buddyLocks[MAX_ORDER + 1];
+static std::mutex mmap_lock;   // guards mmapList
+static std::mutex init_lock;   // guards the one-time initialization
+
 // --------------------------------------------------------------------------------
 // Forward declarations
 // --------------------------------------------------------------------------------
 static bool           initialize_buddy_allocator();
+static void            format_buddy_region();
 static MallocMetadata* allocate_with_mmap(size_t userSize);
 static void            free_mmap_block(MallocMetadata* block);
 static int             get_order(size_t sizeNeeded);
 static MallocMetadata* split_block(MallocMetadata* block);
 static MallocMetadata* getBuddy(MallocMetadata* block);
 static MallocMetadata* merge_blocks(MallocMetadata* b1, MallocMetadata* b2);
+static MallocMetadata* buddy_alloc_block(int order, bool detach);
+static void            buddy_free_block(MallocMetadata* block, bool attach);
+void*                  smalloc(size_t size);
+void                   sfree(void* p);
+
+#ifdef SMALLOC_HAVE_COROUTINES
+// number of coroutines suspended in sasync_alloc; sfree only wakes when != 0
+static std::atomic<size_t> asyncWaiters(0);
+void async_wake_waiters();
+#endif
 
 // --------------------------------------------------------------------------------
 // Aligned initialization: 4MB for buddy
@@ -164,7 +240,6 @@ static MallocMetadata* merge_blocks(MallocMetadata* b1, MallocMetadata* b2);
 static bool initialize_buddy_allocator()
 {
     if (buddy_initialized) return true;
-    buddy_initialized = true;
 
     // 1) Alignment
     void* currBrk = sbrk(0);
@@ -186,12 +261,25 @@ static bool initialize_buddy_allocator()
     }
 
     // 3) Create 32 blocks, each of size=128KB (order=10)
+    format_buddy_region();
+
+    // publish only once the lists are filled; smalloc checks this without a lock
+    buddy_initialized.store(true, std::memory_order_release);
+    return true;
+}
+
+// --------------------------------------------------------------------------------
+// format_buddy_region: carve [BASE, BASE+4MB) into 32 free top blocks
+// --------------------------------------------------------------------------------
+static void format_buddy_region()
+{
     char* runner = BASE;
     for (int i = 0; i < NUM_INIT_BLOCKS; i++) {
         MallocMetadata* block = (MallocMetadata*)runner;
         block->size    = BLOCK_SIZE; // includes metadata
         block->is_free = true;
         block->is_mmap = false;
+        block->tag     = 0;
         block->order   = MAX_ORDER;  // =10
 
         block->next    = nullptr;
@@ -201,10 +289,141 @@ static bool initialize_buddy_allocator()
 
         runner += BLOCK_SIZE;
     }
+}
+
+// --------------------------------------------------------------------------------
+// Persistent file-backed heap
+//   sheap_open_file(path) backs the buddy region with a MAP_SHARED file
+//   instead of sbrk. It must run before the first smalloc. File layout:
+//     [ PersistHeader, padded to one page ][ 4MB buddy region ]
+//   The file only needs the position-independent parts of each header (size,
+//   order, is_free, tag). The next/prev links are derived state: on reopen the
+//   region is walked header by header and buddyArray rebuilt, so the file can
+//   map at a different address. User data should link by offset: see
+//   sheap_offset/sheap_pointer, and sheap_set_root/sheap_get_root for an entry
+//   point that survives the restart.
+//
+//   This is a warm-restart format, not crash recovery. Call sheap_sync before
+//   exit: it returns cached blocks to the lists and msyncs. Blocks still in a
+//   cache (or the emergency reserve) at exit come back as used.
+// --------------------------------------------------------------------------------
+static const uint32_t PERSIST_VERSION = 1;
+static const size_t   PERSIST_HEADER  = 4096;
+static const size_t   REGION_SIZE     = NUM_INIT_BLOCKS * BLOCK_SIZE;
+
+struct PersistHeader {
+    char     magic[8];      // "SMALLOCH"
+    uint32_t version;
+    uint32_t metaDataSize;  // sizeof(MallocMetadata) when written
+    uint64_t regionSize;
+    uint64_t rootOffset;    // sheap_set_root, 0 = none
+};
+static_assert(sizeof(PersistHeader) <= PERSIST_HEADER, "header must fit its page");
+
+static PersistHeader* persistHeader = nullptr;
+
+// rebuild_buddy_lists: relink every block found by walking the region.
+// Caller holds init_lock and the heap isn't published yet. The walk first
+// chains blocks in reverse through .next, so that each addBlock below lands
+// at the list head instead of scanning the sorted list.
+static bool rebuild_buddy_lists()
+{
+    char* end = BASE + REGION_SIZE;
+    MallocMetadata* reversed = nullptr;
+    for (char* runner = BASE; runner < end; ) {
+        MallocMetadata* block = (MallocMetadata*)runner;
+        size_t offset = runner - BASE;
+        if (block->is_mmap || block->order < 0 || block->order > MAX_ORDER ||
+            block->size != (MIN_BLOCK_SIZE << block->order) || offset % block->size != 0 ||
+            block->size > (size_t)(end - runner)) {
+            return false;
+        }
+        block->next = reversed;
+        reversed = block;
+        runner += block->size;
+    }
+    while (reversed) {
+        MallocMetadata* block = reversed;
+        reversed = block->next;
+        buddyArray[block->order].addBlock(block);
+    }
+    return true;
+}
+
+bool sheap_open_file(const char* path)
+{
+    if (!path) return false;
+    std::lock_guard<std::mutex> guard(init_lock);
+    if (buddy_initialized) return false;   // too late, the region is already sbrk'd
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    bool fresh = (st.st_size == 0);
+    if (fresh && ftruncate(fd, PERSIST_HEADER + REGION_SIZE) != 0) {
+        close(fd);
+        return false;
+    }
+    if (!fresh && (size_t)st.st_size != PERSIST_HEADER + REGION_SIZE) {
+        std::cerr << "sheap_open_file: unexpected file size\n";
+        close(fd);
+        return false;
+    }
+
+    void* map = mmap(nullptr, PERSIST_HEADER + REGION_SIZE, PROT_READ|PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    PersistHeader* hdr = (PersistHeader*)map;
+    BASE = (char*)map + PERSIST_HEADER;
+    if (fresh) {
+        memcpy(hdr->magic, "SMALLOCH", 8);
+        hdr->version      = PERSIST_VERSION;
+        hdr->metaDataSize = sizeof(MallocMetadata);
+        hdr->regionSize   = REGION_SIZE;
+        hdr->rootOffset   = 0;
+        format_buddy_region();
+    } else if (memcmp(hdr->magic, "SMALLOCH", 8) != 0 || hdr->version != PERSIST_VERSION ||
+               hdr->metaDataSize != sizeof(MallocMetadata) || hdr->regionSize != REGION_SIZE ||
+               !rebuild_buddy_lists()) {
+        std::cerr << "sheap_open_file: not a compatible heap file\n";
+        for (int i = 0; i <= MAX_ORDER; i++) buddyArray[i] = BlocksList();
+        munmap(map, PERSIST_HEADER + REGION_SIZE);
+        BASE = nullptr;
+        return false;
+    }
 
+    persistHeader = hdr;
+    buddy_initialized.store(true, std::memory_order_release);
     return true;
 }
 
+// offsets are BASE-relative + 1 so that 0 can stand for nullptr
+uint64_t sheap_offset(const void* p)
+{
+    return p ? (uint64_t)((const char*)p - BASE) + 1 : 0;
+}
+
+void* sheap_pointer(uint64_t offset)
+{
+    return offset ? BASE + (offset - 1) : nullptr;
+}
+
+void sheap_set_root(void* p)
+{
+    if (persistHeader) persistHeader->rootOffset = sheap_offset(p);
+}
+
+void* sheap_get_root()
+{
+    return persistHeader ? sheap_pointer(persistHeader->rootOffset) : nullptr;
+}
+
 // --------------------------------------------------------------------------------
 // get_order: find smallest order i s.t. 128*(2^i) >= sizeNeeded
 // --------------------------------------------------------------------------------
@@ -224,6 +443,81 @@ static int get_order(size_t sizeNeeded)
     return -1; // can't handle bigger than 128KB as buddy
 }
 
+// --------------------------------------------------------------------------------
+// Copy-on-write mode for mmap blocks (see sclone)
+//   With smalloc_set_cow_mmap(true), new mmap-sized blocks are memfd pages
+//   mapped MAP_SHARED, so the memfd always holds the block's bytes and the
+//   first sclone doesn't copy anything. Such blocks sit in mmapList with order
+//   COW_ORDER and keep their memfd open in a CowBacking until they are cloned
+//   or freed. The records come from pages mapped for them and recycled under
+//   mmap_lock, not from the heap, so they carry no tag and don't count against
+//   the budget. If no memfd can be had the block is a plain anonymous one.
+// --------------------------------------------------------------------------------
+struct CowBacking {
+    MallocMetadata* block;
+    int             fd;
+    CowBacking*     nextBacking;
+};
+
+static std::atomic<bool> cowMmap(false);
+static CowBacking*       cowBackings = nullptr;   // guarded by mmap_lock
+static CowBacking*       cowSpare    = nullptr;   // unused records, guarded by mmap_lock
+
+void smalloc_set_cow_mmap(bool enable)
+{
+    cowMmap.store(enable);
+}
+
+// cow_unlink: detach block's CowBacking; caller holds mmap_lock
+static CowBacking* cow_unlink(MallocMetadata* block)
+{
+    for (CowBacking** link = &cowBackings; *link; link = &(*link)->nextBacking) {
+        if ((*link)->block == block) {
+            CowBacking* cb = *link;
+            *link = cb->nextBacking;
+            return cb;
+        }
+    }
+    return nullptr;
+}
+
+// cow_backing_new: a record off cowSpare, mapping a page of them if it's
+// empty; caller holds mmap_lock
+static CowBacking* cow_backing_new()
+{
+    if (!cowSpare) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        void* mem = mmap(nullptr, page, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return nullptr;
+        CowBacking* records = (CowBacking*)mem;
+        for (size_t i = 0; i < page / sizeof(CowBacking); i++) {
+            records[i].nextBacking = cowSpare;
+            cowSpare = &records[i];
+        }
+    }
+    CowBacking* cb = cowSpare;
+    cowSpare = cb->nextBacking;
+    return cb;
+}
+
+// cow_backing_release: caller holds mmap_lock
+static void cow_backing_release(CowBacking* cb)
+{
+    cb->nextBacking = cowSpare;
+    cowSpare = cb;
+}
+
+// cow_memfd: a new memfd of `len` bytes, or -1
+static int cow_memfd(size_t len)
+{
+    int fd = memfd_create("smalloc-cow", MFD_CLOEXEC);
+    if (fd >= 0 && ftruncate(fd, len) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
 // --------------------------------------------------------------------------------
 // allocate_with_mmap
 // --------------------------------------------------------------------------------
@@ -231,9 +525,31 @@ static MallocMetadata* allocate_with_mmap(size_t userSize)
 {
     // total size = userSize + metadata
     size_t totalSize = userSize + sizeof(MallocMetadata);
-    void* addr = mmap(nullptr, totalSize,
-                      PROT_READ|PROT_WRITE,
-                      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    void* addr = MAP_FAILED;
+    CowBacking* cb = nullptr;
+    if (cowMmap.load(std::memory_order_relaxed)) {
+        {
+            std::lock_guard<std::mutex> guard(mmap_lock);
+            cb = cow_backing_new();
+        }
+        if (cb) {
+            cb->fd = cow_memfd(totalSize);
+            if (cb->fd >= 0) {
+                addr = mmap(nullptr, totalSize, PROT_READ|PROT_WRITE, MAP_SHARED, cb->fd, 0);
+                if (addr == MAP_FAILED) close(cb->fd);
+            }
+            if (addr == MAP_FAILED) {
+                std::lock_guard<std::mutex> guard(mmap_lock);
+                cow_backing_release(cb);
+                cb = nullptr;
+            }
+        }
+    }
+    if (!cb) {
+        addr = mmap(nullptr, totalSize,
+                    PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    }
     if (addr == MAP_FAILED) {
         return nullptr;
     }
@@ -241,12 +557,21 @@ static MallocMetadata* allocate_with_mmap(size_t userSize)
     block->size    = totalSize;   // includes metadata
     block->is_free = false;
     block->is_mmap = true;
-    block->order   = -1;
+    block->tag     = 0;
+    block->order   = cb ? COW_ORDER : -1;
     block->next    = nullptr;
     block->prev    = nullptr;
 
+    SMALLOC_PROBE2(mmap_alloc, totalSize, addr);
+
     // Insert into mmapList
+    std::lock_guard<std::mutex> guard(mmap_lock);
     mmapList.addBlock(block);
+    if (cb) {
+        cb->block = block;
+        cb->nextBacking = cowBackings;
+        cowBackings = cb;
+    }
 
     return block;
 }
@@ -257,7 +582,27 @@ static MallocMetadata* allocate_with_mmap(size_t userSize)
 static void free_mmap_block(MallocMetadata* block)
 {
     if (!block) return;
-    mmapList.removeBlock(block);
+    SMALLOC_PROBE2(mmap_free, block->size, block);
+    int cowFd = -1;
+    {
+        std::lock_guard<std::mutex> guard(mmap_lock);
+        mmapList.removeBlock(block);
+        if (block->order == COW_ORDER) {
+            if (CowBacking* cb = cow_unlink(block)) {
+                cowFd = cb->fd;
+                cow_backing_release(cb);
+            }
+        }
+    }
+    if (cowFd >= 0) close(cowFd);
+    if (block->order == RING_ORDER || block->order == IO_ORDER) {
+        // header page + the payload (both views of it for a ring)
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t payload = block->size - sizeof(MallocMetadata);
+        size_t views = (block->order == RING_ORDER) ? 2 : 1;
+        munmap((char*)block + sizeof(MallocMetadata) - page, page + views * payload);
+        return;
+    }
     munmap(block, block->size);
 }
 
@@ -295,6 +640,7 @@ static MallocMetadata* split_block(MallocMetadata* block)
     if (!block) return nullptr;
     int oldOrder = block->order;
     size_t oldSize = block->size;
+    SMALLOC_PROBE2(split, block, oldOrder);
 
     // remove from buddyArray[oldOrder]
     buddyArray[oldOrder].removeBlock(block);
@@ -316,6 +662,7 @@ static MallocMetadata* split_block(MallocMetadata* block)
     buddy->size    = half;
     buddy->is_free = true;
     buddy->is_mmap = false;
+    buddy->tag     = 0;
     buddy->order   = newOrder;
     buddy->next    = nullptr;
     buddy->prev    = nullptr;
@@ -345,6 +692,7 @@ static MallocMetadata* merge_blocks(MallocMetadata* b1, MallocMetadata* b2)
     // double b1
     b1->size  *= 2;
     b1->order = order + 1;
+    SMALLOC_PROBE2(merge, b1, b1->order);
 
     // re-insert
     buddyArray[b1->order].addBlock(b1);
@@ -353,218 +701,4332 @@ static MallocMetadata* merge_blocks(MallocMetadata* b1, MallocMetadata* b2)
 }
 
 // --------------------------------------------------------------------------------
-// smalloc
+// buddy_alloc_block
+//   finds a free block in [order..MAX_ORDER], splits it down to `order` and
+//   marks it used. Used blocks stay in buddyArray[order] (the lists hold free
+//   and used blocks alike; that's what the _num_allocated_* stats count) unless
+//   `detach` is set, in which case the block leaves the list (for the caches).
+//
+//   Locks are taken in ascending order: `order` first, then one more per empty
+//   list on the way up. Splitting walks back down and drops each higher lock
+//   as soon as that order has been split.
 // --------------------------------------------------------------------------------
-void* smalloc(size_t size)
+static MallocMetadata* buddy_alloc_block(int order, bool detach)
 {
-    if (size == 0 || size > 100000000) {
-        return nullptr;
-    }
-    // first-time init
-    if (!buddy_initialized) {
-        if (!initialize_buddy_allocator()) {
-            return nullptr;
-        }
-    }
-
-    // If request >= 128KB => use mmap
-    if (size + sizeof(MallocMetadata) >= BLOCK_SIZE) {
-        MallocMetadata* block = allocate_with_mmap(size);
-        if (!block) return nullptr;
-        // user ptr
-        return (char*)block + sizeof(MallocMetadata);
+    size_t needed = MIN_BLOCK_SIZE << order;
+    int top = order;
+    buddyLocks[top].m.lock();
+    MallocMetadata* candidate = buddyArray[top].findFirstFreeBlock(needed);
+    while (!candidate && top < MAX_ORDER) {
+        top++;
+        buddyLocks[top].m.lock();
+        candidate = buddyArray[top].findFirstFreeBlock(needed);
     }
-
-    // BUDDY logic
-    size_t needed = size + sizeof(MallocMetadata);
-    int order = get_order(needed);
-    if (order < 0 || order > MAX_ORDER) {
-        // can't handle
+    if (!candidate) {
+        for (int i = top; i >= order; i--) buddyLocks[i].m.unlock();
         return nullptr;
     }
 
-    // find free block in [order..MAX_ORDER]
-    for (int i = order; i <= MAX_ORDER; i++) {
-        MallocMetadata* candidate = buddyArray[i].findFirstFreeBlock(needed);
-        if (candidate) {
-            // remove it from free list
-            buddyArray[i].removeBlock(candidate);
-
-            // if candidate->order > order => we keep splitting
-            while (candidate->order > order) {
-                candidate = split_block(candidate);
-            }
-
-            // now candidate->order == order, mark used
-            candidate->is_free = false;
-            // remove from free stats
-            buddyArray[order].num_free_blocks--;
-            buddyArray[order].num_free_bytes -= (candidate->size - sizeof(MallocMetadata));
-
-            return (char*)candidate + sizeof(MallocMetadata);
-        }
+    // if candidate->order > order => we keep splitting
+    while (candidate->order > order) {
+        int splitOrder = candidate->order;
+        candidate = split_block(candidate);
+        buddyLocks[splitOrder].m.unlock();
     }
 
-    // no suitable block found
-    return nullptr;
-}
-
-// --------------------------------------------------------------------------------
-// scalloc
-// --------------------------------------------------------------------------------
-void* scalloc(size_t num, size_t size)
-{
-    if (num == 0 || size == 0) return nullptr;
-    // check overflow
-    size_t totalSize = num * size;
-    if (size != 0 && (totalSize / size) != num) {
-        // overflow
-        return nullptr;
+    // now candidate->order == order, mark used
+    candidate->is_free = false;
+    // remove from free stats
+    buddyArray[order].num_free_blocks--;
+    buddyArray[order].num_free_bytes -= (candidate->size - sizeof(MallocMetadata));
+    if (detach) {
+        buddyArray[order].removeBlock(candidate);
     }
-    void* p = smalloc(totalSize);
-    if (!p) return nullptr;
-    memset(p, 0, totalSize);
-    return p;
+    buddyLocks[order].m.unlock();
+    return candidate;
 }
 
 // --------------------------------------------------------------------------------
-// sfree
+// buddy_free_block
+//   marks a used buddy block free and merges it upwards as far as possible.
+//   `attach` re-inserts a block that a cache had detached.
+//
+//   Holding buddyLocks[k] pins every order-k header: nothing can split into,
+//   merge into or leave order k without it. So the buddy check below is stable
+//   once it sees order k; any other order it reads just ends the merge. Each
+//   merge takes the next lock up before dropping the current one.
 // --------------------------------------------------------------------------------
-void sfree(void* p)
+static void buddy_free_block(MallocMetadata* block, bool attach)
 {
-    if (!p) return;
-    MallocMetadata* block = (MallocMetadata*)((char*)p - sizeof(MallocMetadata));
-    if (block->is_free) {
-        return;
+    buddyLocks[block->order].m.lock();
+    if (attach) {
+        buddyArray[block->order].addBlock(block);
     }
-    if (block->is_mmap) {
-        // free via mmap
-        block->is_free = true;
-        free_mmap_block(block);
-        return;
-    }
-
-    // buddy
     block->is_free = true;
-    int order = block->order;
-    buddyArray[order].addBlock(block);
+    buddyArray[block->order].num_free_blocks++;
+    buddyArray[block->order].num_free_bytes += (block->size - sizeof(MallocMetadata));
 
     // try merges
     while (block->order < MAX_ORDER) {
         MallocMetadata* buddy = getBuddy(block);
         if (!buddy) break;
-        if (buddy->is_free && !buddy->is_mmap && buddy->order == block->order) {
-            block = merge_blocks(block, buddy);
-        } else {
+        if (__atomic_load_n(&buddy->order, __ATOMIC_RELAXED) != block->order ||
+            !__atomic_load_n(&buddy->is_free, __ATOMIC_RELAXED) || buddy->is_mmap) {
             break;
         }
+        int lower = block->order;
+        buddyLocks[lower + 1].m.lock();
+        block = merge_blocks(block, buddy);
+        buddyLocks[lower].m.unlock();
     }
+    buddyLocks[block->order].m.unlock();
 }
 
 // --------------------------------------------------------------------------------
-// srealloc
+// Small-block caches (orders 0..CACHE_MAX_ORDER)
+//   A cached block is detached from buddyArray and stays marked used, so a
+//   neighbour's merge never pulls it out of a cache; its .next links it into
+//   the cache and its .prev holds CACHED_MARK, which sfree treats like is_free.
+//   A block a cache handed out keeps CACHE_LIVE_MARK in .prev, so sfree sends
+//   it back through cache_free whatever the mode is by then, and its payload
+//   is in cacheLiveBytes for the budget.
+//   Refills and flushes move CACHE_BATCH blocks at a time through buddyArray.
+//   cacheDetached counts the blocks out of buddyArray (live or cached) and the
+//   cache counts tell the idle ones, which the _num_* stats fold back in.
+//
+//   SMALLOC_CACHE_PER_CPU   : one tagged Treiber stack per CPU and order. The
+//                             CPU id is read from the thread's rseq area, so
+//                             cached memory scales with cores, not threads. A
+//                             migration between reading the id and the CAS only
+//                             costs locality; the CAS keeps it correct.
+//   SMALLOC_CACHE_PER_THREAD: a stack per thread (see "Thread caches"). Also the
+//                             fallback for threads without an rseq registration.
 // --------------------------------------------------------------------------------
-void* srealloc(void* oldp, size_t newSize)
+enum SmallocCacheMode {
+    SMALLOC_CACHE_OFF        = 0,
+    SMALLOC_CACHE_PER_THREAD = 1,
+    SMALLOC_CACHE_PER_CPU    = 2
+};
+
+static const int    CACHE_MAX_ORDER = 5;           // 128B..4KB blocks
+static const int    CACHE_ORDERS    = CACHE_MAX_ORDER + 1;
+static const size_t CACHE_BATCH     = 8;           // blocks per refill/flush
+static const size_t CACHE_CAPACITY  = 32;          // blocks per order per cache
+static const int    MAX_CPUS        = 256;
+
+static std::atomic<int> cache_mode(SMALLOC_CACHE_OFF);
+
+static MallocMetadata* const CACHED_MARK     = (MallocMetadata*)1;  // .prev while in a cache
+static MallocMetadata* const CACHE_LIVE_MARK = (MallocMetadata*)2;  // .prev while handed out
+static std::atomic<size_t>   cacheDetached[CACHE_ORDERS];           // blocks out of buddyArray
+static std::atomic<size_t>   cacheLiveBytes(0);                     // payload handed out
+
+// Per-CPU stack head, packed into one word so a single CAS is ABA-safe:
+//   [ tag:32 | count:12 | index:20 ]   index = offset/MIN_BLOCK_SIZE + 1, 0 = empty
+static_assert(NUM_INIT_BLOCKS * BLOCK_SIZE / MIN_BLOCK_SIZE < (1u << 20),
+              "buddy region too large for the packed cache index");
+static_assert(CACHE_CAPACITY < (1u << 12), "cache capacity too large for the packed count");
+
+static inline uint64_t head_index(uint64_t h) { return h & 0xFFFFF; }
+static inline uint64_t head_count(uint64_t h) { return (h >> 20) & 0xFFF; }
+static inline uint64_t head_tag(uint64_t h)   { return h >> 32; }
+static inline uint64_t pack_head(uint64_t tag, uint64_t count, uint64_t index)
 {
-    if (newSize == 0) {
-        sfree(oldp);
-        return nullptr;
-    }
-    if (!oldp) {
-        return smalloc(newSize);
-    }
+    return ((tag & 0xFFFFFFFF) << 32) | (count << 20) | index;
+}
 
-    MallocMetadata* oldBlock = (MallocMetadata*)((char*)oldp - sizeof(MallocMetadata));
-    size_t oldUserSize = oldBlock->size - sizeof(MallocMetadata);
+static inline uint64_t block_to_index(MallocMetadata* block)
+{
+    return block ? ((char*)block - BASE) / MIN_BLOCK_SIZE + 1 : 0;
+}
 
-    if (oldUserSize >= newSize) {
-        // already big enough
-        return oldp;
-    }
+static inline MallocMetadata* index_to_block(uint64_t index)
+{
+    return index ? (MallocMetadata*)(BASE + (index - 1) * MIN_BLOCK_SIZE) : nullptr;
+}
 
-    // If it's mmap or not enough space => allocate new, copy, free old
-    if (oldBlock->is_mmap) {
-        // if same size, do nothing
-        if (oldUserSize == newSize) {
-            return oldp;
+struct alignas(64) CpuCache {
+    std::atomic<uint64_t> head[CACHE_ORDERS];
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+};
+static CpuCache cpuCaches[MAX_CPUS];
+
+// Push onto a per-CPU stack; false if it already holds CACHE_CAPACITY blocks
+static bool cpu_stack_push(std::atomic<uint64_t>& head, MallocMetadata* block)
+{
+    // marked up front: once the CAS lands another CPU may pop and hand it out
+    block->prev = CACHED_MARK;
+    uint64_t h = head.load(std::memory_order_relaxed);
+    for (;;) {
+        if (head_count(h) >= CACHE_CAPACITY) return false;
+        // stale poppers may still read .next, hence the atomic store
+        __atomic_store_n(&block->next, index_to_block(head_index(h)), __ATOMIC_RELAXED);
+        uint64_t nh = pack_head(head_tag(h) + 1, head_count(h) + 1, block_to_index(block));
+        if (head.compare_exchange_weak(h, nh, std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+            return true;
         }
-        void* newp = smalloc(newSize);
-        if (!newp) return nullptr;
-        memmove(newp, oldp, (oldUserSize < newSize) ? oldUserSize : newSize);
-        sfree(oldp);
-        return newp;
-    } else {
-        // buddy block
-        // simplest approach: allocate new, copy, free old
-        // (You could try merging with buddy to expand in-place, if tests require it)
-        void* newp = smalloc(newSize);
-        if (!newp) return nullptr;
-        memmove(newp, oldp, (oldUserSize < newSize) ? oldUserSize : newSize);
-        sfree(oldp);
-        return newp;
     }
 }
 
-// --------------------------------------------------------------------------------
-// Stats
-//  5) _num_free_blocks     = sum of free blocks
-//  6) _num_free_bytes      = sum of free block sizes minus metadata
-//  7) _num_allocated_blocks= sum of allocated blocks (free + used)
-//  8) _num_allocated_bytes = sum of allocated blocks' sizes minus metadata
-//  9) _num_meta_data_bytes = sum of metadata bytes for all blocks in the heap
-// 10) _size_meta_data      = sizeof(MallocMetadata)
-// --------------------------------------------------------------------------------
-size_t _num_free_blocks()
+static MallocMetadata* cpu_stack_pop(std::atomic<uint64_t>& head)
 {
-    size_t total = 0;
-    for (int i = 0; i <= MAX_ORDER; i++) {
-        total += buddyArray[i].num_free_blocks;
+    uint64_t h = head.load(std::memory_order_acquire);
+    for (;;) {
+        MallocMetadata* top = index_to_block(head_index(h));
+        if (!top) return nullptr;
+        // top may be popped and reused concurrently; the tag makes the CAS fail then
+        MallocMetadata* next = __atomic_load_n(&top->next, __ATOMIC_RELAXED);
+        uint64_t nh = pack_head(head_tag(h) + 1, head_count(h) - 1, block_to_index(next));
+        if (head.compare_exchange_weak(h, nh, std::memory_order_acquire,
+                                       std::memory_order_acquire)) {
+            top->next = nullptr;
+            return top;
+        }
     }
-    total += mmapList.num_free_blocks;
-    return total;
 }
 
-size_t _num_free_bytes()
+#ifdef SMALLOC_HAVE_RSEQ
+// Used only when glibc didn't register rseq for us (e.g. glibc.pthread.rseq=0)
+static thread_local struct rseq own_rseq __attribute__((aligned(32))) = {
+    0, (uint32_t)RSEQ_CPU_ID_UNINITIALIZED, 0, 0
+};
+static thread_local int own_rseq_state = 0;   // 0 = not tried, 1 = registered, -1 = failed
+#endif
+
+// current_cpu_slot: CPU id from the rseq area, or -1 if this thread has none
+static int current_cpu_slot()
 {
-    size_t total = 0;
-    for (int i = 0; i <= MAX_ORDER; i++) {
-        total += buddyArray[i].num_free_bytes;
+#ifdef SMALLOC_HAVE_RSEQ
+    struct rseq* rs = nullptr;
+    if (__rseq_size > 0) {
+        rs = (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+    } else {
+        if (own_rseq_state == 0) {
+            own_rseq_state = (syscall(__NR_rseq, &own_rseq, sizeof(own_rseq), 0, RSEQ_SIG) == 0)
+                             ? 1 : -1;
+        }
+        if (own_rseq_state == 1) rs = &own_rseq;
     }
-    total += mmapList.num_free_bytes;
-    return total;
+    if (rs) {
+        int cpu = (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+        if (cpu >= 0) return cpu % MAX_CPUS;
+    }
+#endif
+    return -1;
 }
 
-size_t _num_allocated_blocks()
+// buddy_take_batch: detach up to n used blocks of `order` from buddyArray
+static size_t buddy_take_batch(int order, MallocMetadata** out, size_t n)
 {
-    size_t total = 0;
-    for (int i = 0; i <= MAX_ORDER; i++) {
-        total += buddyArray[i].num_allocated_blocks;
+    size_t got = 0;
+    while (got < n) {
+        MallocMetadata* block = buddy_alloc_block(order, true);
+        if (!block) break;
+        out[got++] = block;
     }
-    total += mmapList.num_allocated_blocks;
-    return total;
+    if (got) cacheDetached[order].fetch_add(got, std::memory_order_relaxed);
+    return got;
 }
 
-size_t _num_allocated_bytes()
+// buddy_return_list: hand a .next-linked list of detached blocks back to buddyArray
+static void buddy_return_list(MallocMetadata* list)
 {
-    size_t total = 0;
-    for (int i = 0; i <= MAX_ORDER; i++) {
-        total += buddyArray[i].num_allocated_bytes;
+    while (list) {
+        MallocMetadata* next = list->next;
+        cacheDetached[list->order].fetch_sub(1, std::memory_order_relaxed);
+        buddy_free_block(list, true);
+        list = next;
     }
-    total += mmapList.num_allocated_bytes;
-    return total;
 }
 
-size_t _num_meta_data_bytes()
+// --------------------------------------------------------------------------------
+// Thread caches
+//   Records live in a registry that only grows (mmap'd a page at a time) and are
+//   recycled when their thread exits, so peers can always reach them. Only the
+//   owner pushes or pops single blocks; anyone may take a whole stack with one
+//   exchange. That exchange is the transfer path: a miss steals a batch from a
+//   peer with it, and the scavenger drains idle caches with it. With the owner
+//   as the only pusher, its pop CAS can't see an ABA'd head.
+// --------------------------------------------------------------------------------
+static const int    STEAL_PROBES      = 8;            // peers looked at per miss
+static const size_t SCAVENGE_INTERVAL = 256;          // misses between scavenger passes
+static const long   CACHE_TOTAL_LIMIT = 1024 * 1024;  // bytes across all thread caches
+
+struct alignas(64) ThreadCache {
+    std::atomic<MallocMetadata*> head[CACHE_ORDERS];
+    std::atomic<long>            count[CACHE_ORDERS];
+    std::atomic<long>            bytes;     // cached bytes over all orders
+    std::atomic<uint64_t>        ops;       // bumped by the owner, read by the scavenger
+    std::atomic<uint64_t>        hits;      // owner-written, summed by the stats export
+    std::atomic<uint64_t>        misses;
+    uint64_t                     seen_ops;  // scavenger's view at its last pass
+    std::atomic<bool>            in_use;
+    ThreadCache*                 next;      // registry link, fixed once published
+};
+
+static std::atomic<ThreadCache*> cacheRegistry(nullptr);
+static std::atomic<ThreadCache*> stealCursor(nullptr);
+static std::atomic<size_t>       cacheMisses(0);
+static std::atomic_flag          scavenging = ATOMIC_FLAG_INIT;
+
+// The handle's destructor returns the record when its thread exits. Other
+// thread-exit code may still free afterwards (the epoch record's destructor
+// does): threadCacheGone then keeps such frees from claiming a new record,
+// and they go straight back to buddyArray.
+struct ThreadCacheHandle {
+    ThreadCache* tc;
+    ~ThreadCacheHandle();
+};
+static thread_local ThreadCacheHandle threadCache;
+static thread_local bool              threadCacheGone = false;
+
+static void tc_push(ThreadCache* tc, int order, MallocMetadata* block)
 {
-    size_t total = 0;
-    for (int i = 0; i <= MAX_ORDER; i++) {
-        total += buddyArray[i].num_meta_data_bytes;
-    }
-    total += mmapList.num_meta_data_bytes;
-    return total;
+    block->prev = CACHED_MARK;
+    MallocMetadata* h = tc->head[order].load(std::memory_order_relaxed);
+    do {
+        __atomic_store_n(&block->next, h, __ATOMIC_RELAXED);
+    } while (!tc->head[order].compare_exchange_weak(h, block, std::memory_order_release,
+                                                    std::memory_order_relaxed));
+    tc->count[order].fetch_add(1, std::memory_order_relaxed);
+    tc->bytes.fetch_add((long)block->size, std::memory_order_relaxed);
 }
 
-size_t _size_meta_data()
+static MallocMetadata* tc_pop(ThreadCache* tc, int order)
 {
-    return sizeof(MallocMetadata);
+    MallocMetadata* h = tc->head[order].load(std::memory_order_acquire);
+    while (h) {
+        MallocMetadata* next = __atomic_load_n(&h->next, __ATOMIC_RELAXED);
+        if (tc->head[order].compare_exchange_weak(h, next, std::memory_order_acquire,
+                                                  std::memory_order_acquire)) {
+            tc->count[order].fetch_sub(1, std::memory_order_relaxed);
+            tc->bytes.fetch_sub((long)h->size, std::memory_order_relaxed);
+            h->next = nullptr;
+            return h;
+        }
+    }
+    return nullptr;
+}
+
+// tc_take_all: detach a whole stack; safe from any thread
+static MallocMetadata* tc_take_all(ThreadCache* tc, int order)
+{
+    MallocMetadata* list = tc->head[order].exchange(nullptr, std::memory_order_acquire);
+    long n = 0, bytes = 0;
+    for (MallocMetadata* b = list; b; b = b->next) {
+        n++;
+        bytes += (long)b->size;
+    }
+    tc->count[order].fetch_sub(n, std::memory_order_relaxed);
+    tc->bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    return list;
+}
+
+static void thread_cache_flush(ThreadCache* tc)
+{
+    for (int i = 0; i < CACHE_ORDERS; i++) {
+        MallocMetadata* list = tc_take_all(tc, i);
+        if (list) buddy_return_list(list);
+    }
+}
+
+// thread_cache_get: the caller's record, claimed or created on first use
+static ThreadCache* thread_cache_get()
+{
+    // checked first: the destructor's `tc = nullptr` is a dead store to the compiler
+    if (threadCacheGone) return nullptr;
+    if (threadCache.tc) return threadCache.tc;
+
+    // recycle a record left by an exited thread
+    for (ThreadCache* tc = cacheRegistry.load(std::memory_order_acquire); tc; tc = tc->next) {
+        bool expected = false;
+        if (!tc->in_use.load(std::memory_order_relaxed) &&
+            tc->in_use.compare_exchange_strong(expected, true)) {
+            threadCache.tc = tc;
+            return tc;
+        }
+    }
+
+    // none free => map a page of fresh records
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    void* mem = mmap(nullptr, page, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return nullptr;
+    ThreadCache* records = (ThreadCache*)mem;
+    size_t n = page / sizeof(ThreadCache);
+    for (size_t i = 0; i < n; i++) {
+        ThreadCache* tc = new (&records[i]) ThreadCache();
+        tc->in_use.store(i == 0, std::memory_order_relaxed);
+        tc->next = cacheRegistry.load(std::memory_order_relaxed);
+        while (!cacheRegistry.compare_exchange_weak(tc->next, tc, std::memory_order_release,
+                                                    std::memory_order_relaxed)) {
+        }
+    }
+    threadCache.tc = &records[0];
+    return threadCache.tc;
+}
+
+ThreadCacheHandle::~ThreadCacheHandle()
+{
+    threadCacheGone = true;
+    if (!tc) return;
+    thread_cache_flush(tc);
+    tc->in_use.store(false, std::memory_order_release);
+    tc = nullptr;
+}
+
+// next_peer: round-robin over the registry so probes spread across peers
+static ThreadCache* next_peer()
+{
+    ThreadCache* tc = stealCursor.load(std::memory_order_relaxed);
+    ThreadCache* next = (tc && tc->next) ? tc->next : cacheRegistry.load(std::memory_order_acquire);
+    stealCursor.store(next, std::memory_order_relaxed);
+    return next;
+}
+
+// cache_steal: take a peer's whole stack for `order`. With hoarders_only, only
+// peers holding at least half their capacity are robbed.
+static MallocMetadata* cache_steal(ThreadCache* self, int order, bool hoarders_only)
+{
+    long min_count = hoarders_only ? (long)CACHE_CAPACITY / 2 : 1;
+    for (int i = 0; i < STEAL_PROBES; i++) {
+        ThreadCache* peer = next_peer();
+        if (!peer || peer == self) continue;
+        if (peer->count[order].load(std::memory_order_relaxed) < min_count) continue;
+        MallocMetadata* list = tc_take_all(peer, order);
+        if (list) return list;
+    }
+    return nullptr;
+}
+
+// cache_scavenge: drain caches whose owner did nothing since the last pass,
+// then keep draining the largest ones while the total is over the limit
+static void cache_scavenge()
+{
+    if (scavenging.test_and_set(std::memory_order_acquire)) return;
+
+    long total = 0;
+    for (ThreadCache* tc = cacheRegistry.load(std::memory_order_acquire); tc; tc = tc->next) {
+        uint64_t ops = tc->ops.load(std::memory_order_relaxed);
+        if (ops == tc->seen_ops && tc->bytes.load(std::memory_order_relaxed) > 0) {
+            thread_cache_flush(tc);
+        }
+        tc->seen_ops = ops;
+        total += tc->bytes.load(std::memory_order_relaxed);
+    }
+    while (total > CACHE_TOTAL_LIMIT) {
+        ThreadCache* largest = nullptr;
+        long most = 0;
+        for (ThreadCache* tc = cacheRegistry.load(std::memory_order_acquire); tc; tc = tc->next) {
+            long b = tc->bytes.load(std::memory_order_relaxed);
+            if (b > most) {
+                most = b;
+                largest = tc;
+            }
+        }
+        if (!largest) break;
+        thread_cache_flush(largest);
+        total -= most;
+    }
+
+    scavenging.clear(std::memory_order_release);
+}
+
+// --------------------------------------------------------------------------------
+// Cache front-ends used by smalloc/sfree
+// --------------------------------------------------------------------------------
+static MallocMetadata* cpu_cache_alloc(int cpu, int order)
+{
+    MallocMetadata* block = cpu_stack_pop(cpuCaches[cpu].head[order]);
+    if (block) {
+        cpuCaches[cpu].hits.fetch_add(1, std::memory_order_relaxed);
+        return block;
+    }
+    cpuCaches[cpu].misses.fetch_add(1, std::memory_order_relaxed);
+
+    // miss => refill a batch, keep the first for the caller
+    MallocMetadata* batch[CACHE_BATCH];
+    size_t got = buddy_take_batch(order, batch, CACHE_BATCH);
+    if (got == 0) return nullptr;
+
+    MallocMetadata* overflow = nullptr;
+    for (size_t i = 1; i < got; i++) {
+        if (!cpu_stack_push(cpuCaches[cpu].head[order], batch[i])) {
+            batch[i]->next = overflow;
+            overflow = batch[i];
+        }
+    }
+    if (overflow) buddy_return_list(overflow);
+    batch[0]->next = nullptr;
+    return batch[0];
+}
+
+static MallocMetadata* thread_cache_alloc(int order)
+{
+    ThreadCache* tc = thread_cache_get();
+    if (!tc) {
+        // no record => one block, detached like the rest so cache_free can return it
+        MallocMetadata* block;
+        return buddy_take_batch(order, &block, 1) ? block : nullptr;
+    }
+    tc->ops.store(tc->ops.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    MallocMetadata* block = tc_pop(tc, order);
+    if (block) {
+        tc->hits.store(tc->hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return block;
+    }
+    tc->misses.store(tc->misses.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    // miss => rob a hoarding peer, else refill from buddyArray, else rob anyone
+    if (cacheMisses.fetch_add(1, std::memory_order_relaxed) % SCAVENGE_INTERVAL == 0) {
+        cache_scavenge();
+    }
+    MallocMetadata* list = cache_steal(tc, order, true);
+    if (!list) {
+        MallocMetadata* batch[CACHE_BATCH];
+        size_t got = buddy_take_batch(order, batch, CACHE_BATCH);
+        for (size_t i = got; i > 0; i--) {
+            batch[i - 1]->next = list;
+            list = batch[i - 1];
+        }
+    }
+    if (!list) list = cache_steal(tc, order, false);
+    if (!list) return nullptr;
+
+    block = list;
+    list = list->next;
+    block->next = nullptr;
+    MallocMetadata* overflow = nullptr;
+    while (list) {
+        MallocMetadata* next = list->next;
+        if (tc->count[order].load(std::memory_order_relaxed) < (long)CACHE_CAPACITY) {
+            tc_push(tc, order, list);
+        } else {
+            list->next = overflow;
+            overflow = list;
+        }
+        list = next;
+    }
+    if (overflow) buddy_return_list(overflow);
+    return block;
+}
+
+static MallocMetadata* cache_alloc(int order)
+{
+    MallocMetadata* block = nullptr;
+    int cpu = -1;
+    if (cache_mode.load(std::memory_order_relaxed) == SMALLOC_CACHE_PER_CPU) {
+        cpu = current_cpu_slot();
+    }
+    block = (cpu >= 0) ? cpu_cache_alloc(cpu, order) : thread_cache_alloc(order);
+    if (block) {
+        block->prev = CACHE_LIVE_MARK;
+        cacheLiveBytes.fetch_add(block->size - sizeof(MallocMetadata), std::memory_order_relaxed);
+    }
+    return block;
+}
+
+// cache_free: takes a block cache_alloc handed out
+static void cache_free(MallocMetadata* block)
+{
+    int order = block->order;
+    cacheLiveBytes.fetch_sub(block->size - sizeof(MallocMetadata), std::memory_order_relaxed);
+    int mode = cache_mode.load(std::memory_order_relaxed);
+    if (mode == SMALLOC_CACHE_OFF) {
+        // caches switched off since => straight back to buddyArray
+        block->next = nullptr;
+        buddy_return_list(block);
+        return;
+    }
+    if (mode == SMALLOC_CACHE_PER_CPU) {
+        int cpu = current_cpu_slot();
+        if (cpu >= 0) {
+            if (cpu_stack_push(cpuCaches[cpu].head[order], block)) return;
+            // full => flush a batch together with this block
+            block->next = nullptr;
+            for (size_t i = 0; i < CACHE_BATCH; i++) {
+                MallocMetadata* victim = cpu_stack_pop(cpuCaches[cpu].head[order]);
+                if (!victim) break;
+                victim->next = block;
+                block = victim;
+            }
+            buddy_return_list(block);
+            return;
+        }
+    }
+
+    ThreadCache* tc = thread_cache_get();
+    if (tc) {
+        tc->ops.store(tc->ops.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (tc->count[order].load(std::memory_order_relaxed) < (long)CACHE_CAPACITY) {
+            tc_push(tc, order, block);
+            return;
+        }
+        // full => flush a batch together with this block
+        block->next = nullptr;
+        for (size_t i = 0; i < CACHE_BATCH; i++) {
+            MallocMetadata* victim = tc_pop(tc, order);
+            if (!victim) break;
+            victim->next = block;
+            block = victim;
+        }
+    } else {
+        block->next = nullptr;
+    }
+    buddy_return_list(block);
+}
+
+// cache_idle_blocks: blocks of `order` sitting in a per-CPU or per-thread cache
+static size_t cache_idle_blocks(int order)
+{
+    size_t total = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        total += head_count(cpuCaches[cpu].head[order].load(std::memory_order_relaxed));
+    }
+    for (ThreadCache* tc = cacheRegistry.load(std::memory_order_acquire); tc; tc = tc->next) {
+        long n = tc->count[order].load(std::memory_order_relaxed);
+        if (n > 0) total += (size_t)n;
+    }
+    return total;
+}
+
+static void cpu_caches_flush()
+{
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        for (int i = 0; i < CACHE_ORDERS; i++) {
+            MallocMetadata* list = nullptr;
+            while (MallocMetadata* block = cpu_stack_pop(cpuCaches[cpu].head[i])) {
+                block->next = list;
+                list = block;
+            }
+            if (list) buddy_return_list(list);
+        }
+    }
+}
+
+// --------------------------------------------------------------------------------
+// smalloc_set_cache_mode
+//   Switching returns every cached block (per-CPU and per-thread) to buddyArray.
+// --------------------------------------------------------------------------------
+static void cache_purge_all()
+{
+    for (ThreadCache* tc = cacheRegistry.load(std::memory_order_acquire); tc; tc = tc->next) {
+        thread_cache_flush(tc);
+    }
+    cpu_caches_flush();
+}
+
+void smalloc_set_cache_mode(SmallocCacheMode mode)
+{
+    cache_mode.store(mode);
+    if (!buddy_initialized) return;
+    cache_purge_all();
+}
+
+// --------------------------------------------------------------------------------
+// sheap_sync: make a file-backed heap reopenable (see sheap_open_file)
+// --------------------------------------------------------------------------------
+bool sheap_sync()
+{
+    if (!persistHeader) return false;
+    cache_purge_all();
+    return msync(persistHeader, PERSIST_HEADER + REGION_SIZE, MS_SYNC) == 0;
+}
+
+// --------------------------------------------------------------------------------
+// Memory budget
+//   usage = used buddy payload bytes + mmap payload bytes, read straight off the
+//   BlocksList totals (MAX_ORDER + 2 lists, so O(1)), + payload handed out by
+//   the caches (cacheLiveBytes) and by the other engines. Blocks parked in a
+//   cache don't count as used.
+//   - crossing the soft limit runs the reclaim callbacks once and purges the
+//     caches; it re-arms when an sfree brings usage back under the soft limit
+//   - an allocation that would cross the hard limit fails with nullptr
+//   A limit of 0 means "no limit". Nothing is checked while both are 0.
+// --------------------------------------------------------------------------------
+typedef void (*SmallocReclaimFn)(size_t bytesOverSoftLimit, void* ctx);
+
+static const int MAX_RECLAIM_CALLBACKS = 16;
+
+struct ReclaimCallback {
+    SmallocReclaimFn fn;
+    void*            ctx;
+};
+
+static std::atomic<size_t> budgetSoft(0);
+static std::atomic<size_t> budgetHard(0);
+static std::atomic<bool>   budgetEnabled(false);
+static std::atomic<bool>   overSoftLimit(false);
+static std::mutex          reclaim_lock;
+static ReclaimCallback     reclaimCallbacks[MAX_RECLAIM_CALLBACKS];
+static std::atomic<size_t> engineLiveBytes(0);   // see "Allocation engines"
+
+size_t smalloc_budget_usage()
+{
+    size_t used = 0;
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        used += buddyArray[i].num_allocated_bytes - buddyArray[i].num_free_bytes;
+    }
+    used += mmapList.num_allocated_bytes - mmapList.num_free_bytes;
+    used += cacheLiveBytes.load(std::memory_order_relaxed);
+    used += engineLiveBytes.load(std::memory_order_relaxed);
+    return used;
+}
+
+void smalloc_set_limits(size_t softLimit, size_t hardLimit)
+{
+    budgetSoft.store(softLimit);
+    budgetHard.store(hardLimit);
+    overSoftLimit.store(false);
+    budgetEnabled.store(softLimit != 0 || hardLimit != 0);
+}
+
+bool smalloc_add_reclaim_callback(SmallocReclaimFn fn, void* ctx)
+{
+    if (!fn) return false;
+    std::lock_guard<std::mutex> guard(reclaim_lock);
+    for (int i = 0; i < MAX_RECLAIM_CALLBACKS; i++) {
+        if (!reclaimCallbacks[i].fn) {
+            reclaimCallbacks[i].fn  = fn;
+            reclaimCallbacks[i].ctx = ctx;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool smalloc_remove_reclaim_callback(SmallocReclaimFn fn, void* ctx)
+{
+    std::lock_guard<std::mutex> guard(reclaim_lock);
+    for (int i = 0; i < MAX_RECLAIM_CALLBACKS; i++) {
+        if (reclaimCallbacks[i].fn == fn && reclaimCallbacks[i].ctx == ctx) {
+            reclaimCallbacks[i].fn  = nullptr;
+            reclaimCallbacks[i].ctx = nullptr;
+            return true;
+        }
+    }
+    return false;
+}
+
+// budget_admit: may `bytes` more payload be handed out?
+static bool budget_admit(size_t bytes)
+{
+    size_t soft = budgetSoft.load(std::memory_order_relaxed);
+    size_t hard = budgetHard.load(std::memory_order_relaxed);
+    size_t projected = smalloc_budget_usage() + bytes;
+
+    if (soft && projected > soft && !overSoftLimit.exchange(true)) {
+        // callbacks run without allocator locks held, so they may sfree/smalloc
+        ReclaimCallback snapshot[MAX_RECLAIM_CALLBACKS];
+        {
+            std::lock_guard<std::mutex> guard(reclaim_lock);
+            memcpy(snapshot, reclaimCallbacks, sizeof(snapshot));
+        }
+        for (int i = 0; i < MAX_RECLAIM_CALLBACKS; i++) {
+            if (snapshot[i].fn) snapshot[i].fn(projected - soft, snapshot[i].ctx);
+        }
+        cache_purge_all();
+        projected = smalloc_budget_usage() + bytes;
+    }
+    return !hard || projected <= hard;
+}
+
+// budget_release: re-arm the soft limit once usage is back under it
+static void budget_release()
+{
+    size_t soft = budgetSoft.load(std::memory_order_relaxed);
+    if (overSoftLimit.load(std::memory_order_relaxed) && smalloc_budget_usage() < soft) {
+        overSoftLimit.store(false);
+    }
+}
+
+// --------------------------------------------------------------------------------
+// OOM handling
+//   When sbrk/mmap fail or the buddy lists run dry, smalloc first calls the
+//   handler installed with set_oom_handler (like std::set_new_handler) and
+//   retries for as long as it reports that it released something. Allocations
+//   made from inside the handler never re-enter it, so a handler that logs
+//   can't start an allocation storm.
+//
+//   If that still fails, the emergency reserve (top blocks held out of
+//   buddyArray by smalloc_set_emergency_reserve) is handed back to the buddy
+//   lists and the allocation retried once. sfree refills the reserve later,
+//   but only while more free top blocks exist than the reserve wants back.
+//   The reserve only helps buddy-sized requests.
+// --------------------------------------------------------------------------------
+typedef bool (*SmallocOomHandler)(size_t requested);
+
+static std::atomic<SmallocOomHandler> oomHandler(nullptr);
+static thread_local bool              inOomHandler = false;
+
+static std::mutex          reserve_lock;
+static MallocMetadata*     emergencyReserve = nullptr;  // detached top blocks, .next-linked
+static size_t              reserveCount     = 0;
+static size_t              reserveTarget    = 0;
+static std::atomic<bool>   reserveLow(false);
+
+SmallocOomHandler set_oom_handler(SmallocOomHandler handler)
+{
+    return oomHandler.exchange(handler);
+}
+
+// reserve_fill: caller holds reserve_lock
+static void reserve_fill(size_t keepFree)
+{
+    while (reserveCount < reserveTarget &&
+           buddyArray[MAX_ORDER].num_free_blocks > keepFree) {
+        MallocMetadata* block = buddy_alloc_block(MAX_ORDER, true);
+        if (!block) break;
+        block->next = emergencyReserve;
+        emergencyReserve = block;
+        reserveCount++;
+    }
+    reserveLow.store(reserveCount < reserveTarget);
+}
+
+// --------------------------------------------------------------------------------
+// smalloc_set_emergency_reserve: hold `blocks` 128KB blocks back for OOM
+//   returns false if the heap couldn't supply all of them right now
+// --------------------------------------------------------------------------------
+bool smalloc_set_emergency_reserve(size_t blocks)
+{
+    if (!buddy_initialized.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> guard(init_lock);
+        if (!initialize_buddy_allocator()) return false;
+    }
+
+    std::lock_guard<std::mutex> guard(reserve_lock);
+    reserveTarget = blocks;
+    while (reserveCount > reserveTarget) {
+        MallocMetadata* block = emergencyReserve;
+        emergencyReserve = block->next;
+        reserveCount--;
+        buddy_free_block(block, true);
+    }
+    reserve_fill(0);
+    return reserveCount == reserveTarget;
+}
+
+// emergency_release: give the whole reserve back to buddyArray
+static bool emergency_release()
+{
+    std::lock_guard<std::mutex> guard(reserve_lock);
+    if (!emergencyReserve) return false;
+    while (emergencyReserve) {
+        MallocMetadata* block = emergencyReserve;
+        emergencyReserve = block->next;
+        buddy_free_block(block, true);
+    }
+    reserveCount = 0;
+    reserveLow.store(reserveTarget != 0);
+    return true;
+}
+
+// emergency_refill: called by sfree while the reserve is short
+static void emergency_refill()
+{
+    std::unique_lock<std::mutex> guard(reserve_lock, std::try_to_lock);
+    if (!guard.owns_lock()) return;
+    reserve_fill(reserveTarget - reserveCount);
+}
+
+// --------------------------------------------------------------------------------
+// Real-time mode
+//   Threads that called smalloc_set_realtime(true) allocate from a pool of top
+//   blocks reserved up front with smalloc_rt_reserve (prefaulted and, where
+//   allowed, mlocked). The pool keeps one unsorted free list per order plus a
+//   bitmap of the non-empty ones, so smalloc finds a block with one bit scan
+//   and both smalloc and sfree are O(MAX_ORDER): at most MAX_ORDER splits or
+//   merges, no list walks, no syscalls, no budget/OOM/cache machinery. Pool
+//   blocks are freed the same way from any thread.
+//   The only lock is a priority-inheritance mutex, so a preempted low-priority
+//   holder can't stall a real-time thread indefinitely.
+//   Anything a real-time thread does that can't keep that bound (an mmap-sized
+//   request, an empty pool, freeing a block from outside the pool) is counted
+//   in smalloc_rt_violations, reported to the handler if one is set, and then
+//   served by the ordinary path. Pool blocks are held out of buddyArray, so
+//   they don't show in the _num_* stats (like the emergency reserve).
+// --------------------------------------------------------------------------------
+typedef void (*SmallocRtViolationHandler)(const char* what, size_t size);
+
+static thread_local bool        rtThread = false;
+static pthread_mutex_t          rt_lock;
+static bool                     rtLockReady = false;     // set once under rt_config_lock
+static std::mutex               rt_config_lock;          // serializes smalloc_rt_reserve
+static MallocMetadata*          rtFree[MAX_ORDER + 1];   // .next/.prev-linked, unsorted
+static uint32_t                 rtNonEmpty = 0;          // bit k: rtFree[k] != nullptr
+static size_t                   rtTopCount = 0;
+static std::atomic<uint32_t>    rtTopMask(0);            // bit i: top block i is in the pool
+static std::atomic<size_t>      rtViolations(0);
+static std::atomic<SmallocRtViolationHandler> rtViolationHandler(nullptr);
+
+void smalloc_set_realtime(bool enable)
+{
+    rtThread = enable;
+}
+
+SmallocRtViolationHandler smalloc_set_rt_violation_handler(SmallocRtViolationHandler handler)
+{
+    return rtViolationHandler.exchange(handler);
+}
+
+size_t smalloc_rt_violations()
+{
+    return rtViolations.load(std::memory_order_relaxed);
+}
+
+static void rt_violation(const char* what, size_t size)
+{
+    rtViolations.fetch_add(1, std::memory_order_relaxed);
+    if (SmallocRtViolationHandler handler = rtViolationHandler.load()) {
+        handler(what, size);
+    }
+}
+
+// rt_owns: is this buddy block part of the real-time pool?
+static inline bool rt_owns(const MallocMetadata* block)
+{
+    uint32_t mask = rtTopMask.load(std::memory_order_relaxed);
+    if (!mask || (const char*)block < BASE ||
+        (const char*)block >= BASE + NUM_INIT_BLOCKS * BLOCK_SIZE) {
+        return false;
+    }
+    return (mask >> (((const char*)block - BASE) / BLOCK_SIZE)) & 1;
+}
+
+// rt_push/rt_unlink: caller holds rt_lock
+static inline void rt_push(MallocMetadata* block)
+{
+    int order = block->order;
+    block->prev = nullptr;
+    block->next = rtFree[order];
+    if (rtFree[order]) rtFree[order]->prev = block;
+    rtFree[order] = block;
+    rtNonEmpty |= 1u << order;
+}
+
+static inline void rt_unlink(MallocMetadata* block)
+{
+    int order = block->order;
+    if (block->prev) block->prev->next = block->next;
+    else rtFree[order] = block->next;
+    if (block->next) block->next->prev = block->prev;
+    if (!rtFree[order]) rtNonEmpty &= ~(1u << order);
+}
+
+static void* rt_alloc(size_t size)
+{
+    if (size + sizeof(MallocMetadata) >= BLOCK_SIZE) return nullptr;
+    int order = get_order(size + sizeof(MallocMetadata));
+    if (!rtLockReady || order < 0) return nullptr;
+
+    pthread_mutex_lock(&rt_lock);
+    uint32_t avail = rtNonEmpty & ~((1u << order) - 1);
+    if (!avail) {
+        pthread_mutex_unlock(&rt_lock);
+        return nullptr;
+    }
+    MallocMetadata* block = rtFree[__builtin_ctz(avail)];
+    rt_unlink(block);
+    while (block->order > order) {
+        // keep the lower half, the upper half goes on the next list down
+        block->order--;
+        block->size /= 2;
+        MallocMetadata* buddy = (MallocMetadata*)((char*)block + block->size);
+        buddy->size    = block->size;
+        buddy->is_free = true;
+        buddy->is_mmap = false;
+        buddy->tag     = 0;
+        buddy->order   = block->order;
+        rt_push(buddy);
+    }
+    block->is_free = false;
+    block->next    = nullptr;
+    block->prev    = nullptr;
+    pthread_mutex_unlock(&rt_lock);
+    return (char*)block + sizeof(MallocMetadata);
+}
+
+static void rt_free(MallocMetadata* block)
+{
+    pthread_mutex_lock(&rt_lock);
+    block->is_free = true;
+    while (block->order < MAX_ORDER) {
+        MallocMetadata* buddy = getBuddy(block);
+        if (buddy->order != block->order || !buddy->is_free) break;
+        rt_unlink(buddy);
+        if (buddy < block) block = buddy;
+        block->order++;
+        block->size *= 2;
+    }
+    rt_push(block);
+    pthread_mutex_unlock(&rt_lock);
+}
+
+// rt_lock_init: caller holds rt_config_lock
+static void rt_lock_init()
+{
+    if (rtLockReady) return;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&rt_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    rtLockReady = true;
+}
+
+// --------------------------------------------------------------------------------
+// smalloc_rt_reserve: size the real-time pool to `blocks` 128KB top blocks
+//   Shrinking only gives back top blocks that are entirely free. Returns false
+//   if the pool couldn't be brought to exactly `blocks`.
+// --------------------------------------------------------------------------------
+bool smalloc_rt_reserve(size_t blocks)
+{
+    if (!buddy_initialized.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> guard(init_lock);
+        if (!initialize_buddy_allocator()) return false;
+    }
+
+    std::lock_guard<std::mutex> guard(rt_config_lock);
+    rt_lock_init();
+
+    // rt_lock is never held across buddy_alloc_block/buddy_free_block, and a
+    // buddy lock is only ever taken before it (as the heap walker does).
+    // rt_config_lock keeps rtTopCount ours meanwhile.
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    while (rtTopCount < blocks) {
+        MallocMetadata* block = buddy_alloc_block(MAX_ORDER, true);
+        if (!block) break;
+        // fault every page in now rather than on a real-time thread later
+        for (size_t off = page; off < BLOCK_SIZE; off += page) {
+            ((volatile char*)block)[off] = 0;
+        }
+        mlock(block, BLOCK_SIZE);   // best effort, RLIMIT_MEMLOCK may refuse
+        // a walker holds every order lock, so it sees a buddy block or a pool block
+        buddyLocks[MAX_ORDER].m.lock();
+        pthread_mutex_lock(&rt_lock);
+        block->is_free = true;
+        rt_push(block);
+        rtTopMask.fetch_or(1u << (((char*)block - BASE) / BLOCK_SIZE));
+        rtTopCount++;
+        pthread_mutex_unlock(&rt_lock);
+        buddyLocks[MAX_ORDER].m.unlock();
+    }
+    while (rtTopCount > blocks) {
+        pthread_mutex_lock(&rt_lock);
+        MallocMetadata* block = rtFree[MAX_ORDER];
+        if (block) {
+            rt_unlink(block);
+            rtTopMask.fetch_and(~(1u << (((char*)block - BASE) / BLOCK_SIZE)));
+            rtTopCount--;
+            block->is_free = false;
+        }
+        pthread_mutex_unlock(&rt_lock);
+        if (!block) break;
+        munlock(block, BLOCK_SIZE);
+        buddy_free_block(block, true);
+    }
+    return rtTopCount == blocks;
+}
+
+// --------------------------------------------------------------------------------
+// Allocation engines
+//   Buddy-sized requests go to buddyArray unless smalloc_set_engine_range has
+//   routed their size to another engine (first matching engine wins). Engines
+//   work inside the same BASE region with the same MallocMetadata in front of
+//   every payload: each takes whole 128KB top blocks ("arenas") out of
+//   buddyArray and gives them back once they are entirely free. topEngine
+//   records the owner of every top block so sfree can dispatch. Payload handed
+//   out by engines counts towards the budget through engineLiveBytes.
+//   Heaps that use other engines can't be reopened from a file or restored
+//   from a snapshot while arenas are out.
+// --------------------------------------------------------------------------------
+enum SmallocEngine {
+    SMALLOC_ENGINE_BUDDY = 0,   // buddyArray, the default for every size
+    SMALLOC_ENGINE_TLSF  = 1,
+    SMALLOC_ENGINE_TREE  = 2,
+    SMALLOC_ENGINE_LOCKFREE = 3,
+    SMALLOC_ENGINE_COUNT
+};
+
+static std::atomic<size_t>  engineMin[SMALLOC_ENGINE_COUNT];
+static std::atomic<size_t>  engineMax[SMALLOC_ENGINE_COUNT];
+static std::atomic<bool>    enginesRouted(false);
+static std::atomic<uint8_t> topEngine[NUM_INIT_BLOCKS];
+
+// --------------------------------------------------------------------------------
+// smalloc_set_engine_range: send payload sizes [minSize, maxSize] to `engine`
+//   minSize > maxSize (or maxSize 0) takes the engine out of routing again. Blocks
+//   already handed out stay with the engine that made them.
+// --------------------------------------------------------------------------------
+bool smalloc_set_engine_range(SmallocEngine engine, size_t minSize, size_t maxSize)
+{
+    if (engine <= SMALLOC_ENGINE_BUDDY || engine >= SMALLOC_ENGINE_COUNT) return false;
+    engineMin[engine].store(minSize);
+    engineMax[engine].store(maxSize);
+    bool routed = false;
+    for (int e = SMALLOC_ENGINE_BUDDY + 1; e < SMALLOC_ENGINE_COUNT; e++) {
+        // an engine never configured has [0, 0], which matches no request
+        size_t max = engineMax[e].load();
+        routed |= max != 0 && engineMin[e].load() <= max;
+    }
+    enginesRouted.store(routed);
+    return true;
+}
+
+static SmallocEngine engine_for(size_t size)
+{
+    if (!enginesRouted.load(std::memory_order_relaxed)) return SMALLOC_ENGINE_BUDDY;
+    for (int e = SMALLOC_ENGINE_BUDDY + 1; e < SMALLOC_ENGINE_COUNT; e++) {
+        if (engineMin[e].load(std::memory_order_relaxed) <= size &&
+            size <= engineMax[e].load(std::memory_order_relaxed)) {
+            return (SmallocEngine)e;
+        }
+    }
+    return SMALLOC_ENGINE_BUDDY;
+}
+
+static inline SmallocEngine engine_of(const MallocMetadata* block)
+{
+    if ((const char*)block < BASE || (const char*)block >= BASE + NUM_INIT_BLOCKS * BLOCK_SIZE) {
+        return SMALLOC_ENGINE_BUDDY;
+    }
+    return (SmallocEngine)topEngine[((const char*)block - BASE) / BLOCK_SIZE].load(
+        std::memory_order_relaxed);
+}
+
+static inline char* arena_of(const MallocMetadata* block)
+{
+    return BASE + (((const char*)block - BASE) & ~(BLOCK_SIZE - 1));
+}
+
+// engine_take_arena: a detached top block for `engine`, or nullptr
+static MallocMetadata* engine_take_arena(SmallocEngine engine)
+{
+    MallocMetadata* arena = buddy_alloc_block(MAX_ORDER, true);
+    if (arena) {
+        topEngine[((char*)arena - BASE) / BLOCK_SIZE].store(engine);
+    }
+    return arena;
+}
+
+// engine_return_arena: hand an entirely free arena back to buddyArray
+static void engine_return_arena(char* arena)
+{
+    // header first: a walker that sees the arena as buddy again steps over it
+    MallocMetadata* block = (MallocMetadata*)arena;
+    block->size    = BLOCK_SIZE;
+    block->is_free = false;
+    block->is_mmap = false;
+    block->tag     = 0;
+    block->order   = MAX_ORDER;
+    topEngine[(arena - BASE) / BLOCK_SIZE].store(SMALLOC_ENGINE_BUDDY);
+    buddy_free_block(block, true);
+}
+
+// --------------------------------------------------------------------------------
+// TLSF engine (Two-Level Segregated Fit)
+//   Blocks are any multiple of 16 bytes, so a 3KB request costs ~3KB instead
+//   of a 4KB buddy block. Free blocks sit on one list per (first level =
+//   log2 of the size, second level = which of 16 slices of that power of two)
+//   and two bitmaps say which lists are non-empty, so finding a good fit is
+//   two bit scans: O(1) allocate and free under one mutex.
+//   Inside an arena the blocks tile it exactly (the heap walker still steps
+//   through them). In TLSF blocks .prev is the physically preceding block
+//   (nullptr for the arena's first), which is the boundary tag used to
+//   coalesce with the left neighbour; the right one is at block + size. Free
+//   blocks link their list through .next forwards and through their first
+//   payload word backwards. One entirely free arena is kept as a spare.
+// --------------------------------------------------------------------------------
+static const int    TLSF_SL_LOG = 4;
+static const int    TLSF_SL     = 1 << TLSF_SL_LOG;
+static const int    TLSF_FL     = 18;     // first levels up to 2^17 = BLOCK_SIZE
+static const size_t TLSF_ALIGN  = 16;
+static const size_t TLSF_MIN    = sizeof(MallocMetadata) + TLSF_ALIGN;   // header + back link
+
+static std::mutex       tlsf_lock;
+static uint32_t         tlsfFlMap = 0;
+static uint32_t         tlsfSlMap[TLSF_FL];
+static MallocMetadata*  tlsfHead[TLSF_FL][TLSF_SL];
+static size_t           tlsfArenas = 0;
+
+static inline MallocMetadata*& tlsf_back(MallocMetadata* block)
+{
+    return *(MallocMetadata**)(block + 1);
+}
+
+static inline void tlsf_mapping(size_t size, int* fl, int* sl)
+{
+    *fl = 63 - __builtin_clzll(size);
+    *sl = (int)(size >> (*fl - TLSF_SL_LOG)) & (TLSF_SL - 1);
+}
+
+// tlsf_insert/tlsf_remove: caller holds tlsf_lock
+static void tlsf_insert(MallocMetadata* block)
+{
+    int fl, sl;
+    tlsf_mapping(block->size, &fl, &sl);
+    block->is_free = true;
+    block->next = tlsfHead[fl][sl];
+    tlsf_back(block) = nullptr;
+    if (block->next) tlsf_back(block->next) = block;
+    tlsfHead[fl][sl] = block;
+    tlsfFlMap |= 1u << fl;
+    tlsfSlMap[fl] |= 1u << sl;
+}
+
+static void tlsf_remove(MallocMetadata* block)
+{
+    int fl, sl;
+    tlsf_mapping(block->size, &fl, &sl);
+    MallocMetadata* back = tlsf_back(block);
+    if (back) back->next = block->next;
+    else tlsfHead[fl][sl] = block->next;
+    if (block->next) tlsf_back(block->next) = back;
+    if (!tlsfHead[fl][sl]) {
+        tlsfSlMap[fl] &= ~(1u << sl);
+        if (!tlsfSlMap[fl]) tlsfFlMap &= ~(1u << fl);
+    }
+}
+
+// tlsf_find: a free block of at least `size`, from the first list whose
+// every block is big enough (size rounded up to the next slice)
+static MallocMetadata* tlsf_find(size_t size)
+{
+    int fl, sl;
+    tlsf_mapping(size, &fl, &sl);
+    tlsf_mapping(size + ((size_t)1 << (fl - TLSF_SL_LOG)) - 1, &fl, &sl);
+    if (fl >= TLSF_FL) return nullptr;
+    uint32_t slMap = tlsfSlMap[fl] & (~0u << sl);
+    if (!slMap) {
+        uint32_t flMap = (fl + 1 < 32) ? (tlsfFlMap & (~0u << (fl + 1))) : 0;
+        if (!flMap) return nullptr;
+        fl = __builtin_ctz(flMap);
+        slMap = tlsfSlMap[fl];
+    }
+    return tlsfHead[fl][__builtin_ctz(slMap)];
+}
+
+static MallocMetadata* tlsf_alloc(size_t size)
+{
+    size_t need = (size + sizeof(MallocMetadata) + TLSF_ALIGN - 1) & ~(TLSF_ALIGN - 1);
+    if (need < TLSF_MIN) need = TLSF_MIN;
+
+    std::unique_lock<std::mutex> guard(tlsf_lock);
+    MallocMetadata* block;
+    while (!(block = tlsf_find(need))) {
+        // buddyArray's locks are never taken under tlsf_lock
+        guard.unlock();
+        MallocMetadata* arena = engine_take_arena(SMALLOC_ENGINE_TLSF);
+        if (!arena) return nullptr;
+        arena->size    = BLOCK_SIZE;
+        arena->is_mmap = false;
+        arena->tag     = 0;
+        arena->order   = TLSF_ORDER;
+        arena->prev    = nullptr;
+        guard.lock();
+        tlsfArenas++;
+        tlsf_insert(arena);
+    }
+    tlsf_remove(block);
+
+    if (block->size - need >= TLSF_MIN) {
+        MallocMetadata* rest = (MallocMetadata*)((char*)block + need);
+        rest->size    = block->size - need;
+        rest->is_mmap = false;
+        rest->tag     = 0;
+        rest->order   = TLSF_ORDER;
+        rest->prev    = block;
+        char* after = (char*)rest + rest->size;
+        if (after < arena_of(block) + BLOCK_SIZE) ((MallocMetadata*)after)->prev = rest;
+        block->size = need;
+        tlsf_insert(rest);
+    }
+    block->is_free = false;
+    return block;
+}
+
+static void tlsf_free(MallocMetadata* block)
+{
+    char* arena = arena_of(block);
+    char* end = arena + BLOCK_SIZE;
+    bool release = false;
+    {
+        std::lock_guard<std::mutex> guard(tlsf_lock);
+        block->is_free = true;
+        MallocMetadata* left = block->prev;
+        if (left && left->is_free) {
+            tlsf_remove(left);
+            left->size += block->size;
+            block = left;
+        }
+        MallocMetadata* right = (MallocMetadata*)((char*)block + block->size);
+        if ((char*)right < end && right->is_free) {
+            tlsf_remove(right);
+            block->size += right->size;
+        }
+        char* after = (char*)block + block->size;
+        if (after < end) ((MallocMetadata*)after)->prev = block;
+
+        if (block->size == BLOCK_SIZE && tlsfArenas > 1) {
+            tlsfArenas--;
+            release = true;
+        } else {
+            tlsf_insert(block);
+        }
+    }
+    if (release) engine_return_arena(arena);
+}
+
+// --------------------------------------------------------------------------------
+// Implicit buddy tree engine
+//   Each arena's buddy state is one byte per node of an implicit binary tree:
+//   node 1 is the whole 128KB block, node i has children 2i and 2i+1, and a
+//   node of order k covers 128 << k bytes. A node holds 1 + the largest order
+//   still free anywhere below it (0 = nothing free), so an arena costs 2KB of
+//   state and allocate/free are O(MAX_ORDER) walks over it: down to a free
+//   node of the wanted order, then back up fixing the maxima. Free blocks
+//   have no header at all - only used blocks carry MallocMetadata (size, real
+//   order, tag, and .next/.prev cleared so a buddy-era cache mark left in the
+//   memory can't fool sfree). Children of a node that is
+//   entirely free may hold stale values and are reset on the way down.
+//   One entirely free arena is kept as a spare. The heap walker reports the
+//   used blocks of these arenas only.
+// --------------------------------------------------------------------------------
+static const int TREE_NODES = 2 << MAX_ORDER;   // index 1..2^(MAX_ORDER+1)-1
+
+static std::mutex tree_lock;
+static uint8_t    treeState[NUM_INIT_BLOCKS][TREE_NODES];
+static uint32_t   treeArenas = 0;                // bit i: top block i runs this engine
+
+static inline int tree_full(int order)
+{
+    return order + 1;
+}
+
+// node_block: where node `node` (of order `order`) of an arena's tree starts
+static inline MallocMetadata* node_block(int arena, int node, int order)
+{
+    return (MallocMetadata*)(BASE + arena * BLOCK_SIZE +
+                             (size_t)(node - (1 << (MAX_ORDER - order))) * (MIN_BLOCK_SIZE << order));
+}
+
+// tree_fix_up: recompute the ancestors of `node` (order `order`); caller holds tree_lock
+static void tree_fix_up(uint8_t* tree, int node, int order)
+{
+    for (; node > 1; node /= 2, order++) {
+        uint8_t left = tree[node & ~1];
+        uint8_t right = tree[node | 1];
+        tree[node / 2] = (left == tree_full(order) && right == tree_full(order))
+                             ? (uint8_t)tree_full(order + 1)
+                             : (left > right ? left : right);
+    }
+}
+
+static MallocMetadata* tree_alloc(size_t size)
+{
+    int order = get_order(size + sizeof(MallocMetadata));
+    if (order < 0) return nullptr;
+
+    std::unique_lock<std::mutex> guard(tree_lock);
+    int arena = -1;
+    for (;;) {
+        for (uint32_t m = treeArenas; m; m &= m - 1) {
+            int i = __builtin_ctz(m);
+            if (treeState[i][1] >= tree_full(order)) {
+                arena = i;
+                break;
+            }
+        }
+        if (arena >= 0) break;
+        // buddyArray's locks are never taken under tree_lock
+        guard.unlock();
+        MallocMetadata* top = engine_take_arena(SMALLOC_ENGINE_TREE);
+        if (!top) return nullptr;
+        guard.lock();
+        int i = (int)(((char*)top - BASE) / BLOCK_SIZE);
+        treeState[i][1] = (uint8_t)tree_full(MAX_ORDER);
+        treeArenas |= 1u << i;
+    }
+
+    uint8_t* tree = treeState[arena];
+    int node = 1;
+    for (int k = MAX_ORDER; k > order; k--) {
+        if (tree[node] == tree_full(k)) {
+            tree[2 * node] = tree[2 * node + 1] = (uint8_t)tree_full(k - 1);
+        }
+        node = (tree[2 * node] >= tree_full(order)) ? 2 * node : 2 * node + 1;
+    }
+    tree[node] = 0;
+    tree_fix_up(tree, node, order);
+    guard.unlock();
+
+    MallocMetadata* block = node_block(arena, node, order);
+    block->size    = MIN_BLOCK_SIZE << order;
+    block->is_free = false;
+    block->is_mmap = false;
+    block->tag     = 0;
+    block->order   = order;
+    block->next    = nullptr;   // stale links could read as a cache mark in sfree
+    block->prev    = nullptr;
+    return block;
+}
+
+static void tree_free(MallocMetadata* block)
+{
+    int arena = (int)(((char*)block - BASE) / BLOCK_SIZE);
+    int order = block->order;
+    size_t offset = (char*)block - arena_of(block);
+    int node = (1 << (MAX_ORDER - order)) + (int)(offset / block->size);
+    bool release = false;
+    {
+        std::lock_guard<std::mutex> guard(tree_lock);
+        block->is_free = true;
+        uint8_t* tree = treeState[arena];
+        tree[node] = (uint8_t)tree_full(order);
+        tree_fix_up(tree, node, order);
+        if (tree[1] == tree_full(MAX_ORDER) && (treeArenas & (treeArenas - 1))) {
+            treeArenas &= ~(1u << arena);
+            release = true;
+        }
+    }
+    if (release) engine_return_arena(BASE + arena * BLOCK_SIZE);
+}
+
+// tree_walk: report the used blocks of a tree arena; caller holds tree_lock.
+// A node with nothing free below is one used block iff the header at its
+// address is a live block of exactly its order (a block allocated later at
+// the same address, from a child, would have overwritten that header).
+template <typename Fn>
+static bool tree_walk(int arena, int node, int order, Fn& fn)
+{
+    uint8_t value = treeState[arena][node];
+    if (value == tree_full(order)) return true;
+    MallocMetadata* block = node_block(arena, node, order);
+    if (value == 0 && block->order == order && !block->is_free) return fn(block, *block);
+    if (order == 0) return true;
+    return tree_walk(arena, 2 * node, order - 1, fn) &&
+           tree_walk(arena, 2 * node + 1, order - 1, fn);
+}
+
+// --------------------------------------------------------------------------------
+// Lock-free buddy engine
+//   The non-blocking buddy system of Marotta et al. (NBBS) over the same
+//   implicit tree layout as the tree engine, one atomic status byte per node:
+//     LF_OCC                    the node is allocated as a whole
+//     LF_OCC_LEFT/RIGHT         something in that child's subtree is allocated
+//     LF_COAL_LEFT/RIGHT        a free in that child's subtree is still
+//                               clearing its way up
+//   Allocating CASes a free node at the wanted order to busy, then sets the
+//   OCC_ bit for its side in every ancestor, backing out if one of them is
+//   allocated as a whole. Freeing first flags COAL_ bits up to the first
+//   ancestor whose other half is in use, releases the node, then clears the
+//   OCC_/COAL_ pairs on the way up - unless an allocation claimed that half
+//   meanwhile (it clears the COAL_ bit, which stops the free). Operations on
+//   disjoint subtrees never touch the same byte; contended ones retry their
+//   CAS. Threads start scanning at different nodes and arenas.
+//   Arenas are taken under a lock when every arena is full, at most
+//   LF_MAX_ARENAS of them. A free that leaves an arena entirely free gives it
+//   back (keeping one as a spare): it claims the root as if allocating the
+//   whole arena, which turns away every later allocation there, and only goes
+//   on if lfUsers says no other operation is inside the arena - each alloc
+//   and free counts itself in before touching the tree. A returned arena keeps
+//   its root claimed until it is taken again. The heap walker's view of these
+//   arenas is best effort: it sees used blocks whose header is already
+//   written and can't stop the engine.
+// --------------------------------------------------------------------------------
+static const uint8_t LF_OCC_RIGHT  = 0x01;
+static const uint8_t LF_OCC_LEFT   = 0x02;
+static const uint8_t LF_COAL_RIGHT = 0x04;
+static const uint8_t LF_COAL_LEFT  = 0x08;
+static const uint8_t LF_OCC        = 0x10;
+static const uint8_t LF_BUSY       = LF_OCC | LF_OCC_LEFT | LF_OCC_RIGHT;
+
+static const int LF_MAX_ARENAS = NUM_INIT_BLOCKS / 2;
+
+struct alignas(64) LfUsers {
+    std::atomic<uint32_t> n;   // allocs/frees currently inside the arena
+};
+
+static std::atomic<uint8_t>  lfTree[NUM_INIT_BLOCKS][TREE_NODES];
+static LfUsers               lfUsers[NUM_INIT_BLOCKS];
+static std::atomic<uint32_t> lfArenas(0);    // bit i: top block i runs this engine
+static std::mutex            lf_grow_lock;   // for taking and giving back arenas
+static thread_local uint8_t  lfHint;         // its address spreads threads out
+
+static inline int lf_depth(int node)
+{
+    return 31 - __builtin_clz(node);
+}
+
+// bits a parent keeps for `child`, and for child's buddy
+static inline uint8_t lf_occ_bit(int child)  { return (child & 1) ? LF_OCC_RIGHT : LF_OCC_LEFT; }
+static inline uint8_t lf_coal_bit(int child) { return (child & 1) ? LF_COAL_RIGHT : LF_COAL_LEFT; }
+
+// lf_unmark: clear the marks of a freed subtree up the path, stopping at the
+// first ancestor where an allocation took the half back or the other half is used
+static void lf_unmark(std::atomic<uint8_t>* tree, int node, int upper)
+{
+    int current = node;
+    int child;
+    uint8_t newVal;
+    do {
+        child = current;
+        current /= 2;
+        uint8_t cur = tree[current].load();
+        do {
+            if (!(cur & lf_coal_bit(child))) return;
+            newVal = cur & (uint8_t)~(lf_coal_bit(child) | lf_occ_bit(child));
+        } while (!tree[current].compare_exchange_weak(cur, newVal));
+    } while (lf_depth(current) > upper && !(newVal & lf_occ_bit(child ^ 1)));
+}
+
+// lf_free_node: release `node`, clearing marks no higher than depth `upper`
+static void lf_free_node(std::atomic<uint8_t>* tree, int node, int upper)
+{
+    for (int runner = node; lf_depth(runner) > upper; runner /= 2) {
+        uint8_t old = tree[runner / 2].fetch_or(lf_coal_bit(runner));
+        if ((old & lf_occ_bit(runner ^ 1)) && !(old & lf_coal_bit(runner ^ 1))) break;
+    }
+    tree[node].store(0);
+    if (lf_depth(node) != upper) lf_unmark(tree, node, upper);
+}
+
+// lf_try_alloc: 0 on success, else the node where it failed
+static int lf_try_alloc(std::atomic<uint8_t>* tree, int node)
+{
+    uint8_t expected = 0;
+    if (!tree[node].compare_exchange_strong(expected, LF_BUSY)) return node;
+    for (int current = node; current > 1; ) {
+        int child = current;
+        current /= 2;
+        uint8_t cur = tree[current].load();
+        uint8_t newVal;
+        do {
+            if (cur & LF_OCC) {
+                lf_free_node(tree, node, lf_depth(child));
+                return current;
+            }
+            newVal = (uint8_t)((cur & ~lf_coal_bit(child)) | lf_occ_bit(child));
+        } while (!tree[current].compare_exchange_weak(cur, newVal));
+    }
+    return 0;
+}
+
+static MallocMetadata* lf_alloc_in(int arena, int order)
+{
+    std::atomic<uint8_t>* tree = lfTree[arena];
+    int depth = MAX_ORDER - order;
+    int first = 1 << depth;
+    int count = 1 << depth;
+    int start = (int)(((uintptr_t)&lfHint >> 6) % count);
+    for (int scanned = 0; scanned < count; ) {
+        int node = first + (start + scanned) % count;
+        if (tree[node].load(std::memory_order_relaxed) != 0) {
+            scanned++;
+            continue;
+        }
+        int failedAt = lf_try_alloc(tree, node);
+        if (failedAt == 0) return node_block(arena, node, order);
+        // nothing under failedAt is free at this order; skip to the node after it
+        scanned += ((failedAt + 1) << (depth - lf_depth(failedAt))) - node;
+    }
+    return nullptr;
+}
+
+static MallocMetadata* lf_alloc(size_t size)
+{
+    int order = get_order(size + sizeof(MallocMetadata));
+    if (order < 0) return nullptr;
+    int home = (int)(((uintptr_t)&lfHint >> 6) % NUM_INIT_BLOCKS);
+    for (;;) {
+        uint32_t arenas = lfArenas.load(std::memory_order_acquire);
+        for (int k = 0; k < NUM_INIT_BLOCKS; k++) {
+            int i = (home + k) % NUM_INIT_BLOCKS;
+            if (!(arenas & (1u << i))) continue;
+            // count in before looking at the root; pairs with lf_release_arena
+            lfUsers[i].n.fetch_add(1);
+            MallocMetadata* block = nullptr;
+            if (!(lfTree[i][1].load() & LF_OCC)) block = lf_alloc_in(i, order);
+            lfUsers[i].n.fetch_sub(1);
+            if (block) {
+                block->size    = MIN_BLOCK_SIZE << order;
+                block->is_free = false;
+                block->is_mmap = false;
+                block->tag     = 0;
+                block->order   = order;
+                block->next    = nullptr;   // as in tree_alloc
+                block->prev    = nullptr;
+                return block;
+            }
+        }
+        // every arena looked full: add one, unless another thread just did
+        std::lock_guard<std::mutex> guard(lf_grow_lock);
+        if (lfArenas.load() != arenas) continue;
+        if (__builtin_popcount(arenas) >= LF_MAX_ARENAS) return nullptr;
+        MallocMetadata* top = engine_take_arena(SMALLOC_ENGINE_LOCKFREE);
+        if (!top) return nullptr;
+        int i = (int)(((char*)top - BASE) / BLOCK_SIZE);
+        lfTree[i][1].store(0);   // a returned arena kept its root claimed
+        lfArenas.fetch_or(1u << i, std::memory_order_release);
+    }
+}
+
+// lf_release_arena: give back an arena whose root just read free, unless it's
+// the last one or an operation is inside it
+static void lf_release_arena(int arena)
+{
+    std::lock_guard<std::mutex> guard(lf_grow_lock);
+    uint32_t arenas = lfArenas.load();
+    if (!(arenas & (1u << arena)) || !(arenas & ~(1u << arena))) return;
+    uint8_t expected = 0;
+    if (!lfTree[arena][1].compare_exchange_strong(expected, LF_BUSY)) return;
+    if (lfUsers[arena].n.load() != 0) {
+        // someone counted in before our claim; a later free retries
+        lfTree[arena][1].store(0);
+        return;
+    }
+    lfArenas.fetch_and(~(1u << arena));
+    engine_return_arena(BASE + arena * BLOCK_SIZE);
+}
+
+static void lf_free(MallocMetadata* block)
+{
+    int arena = (int)(((char*)block - BASE) / BLOCK_SIZE);
+    int node = (1 << (MAX_ORDER - block->order)) +
+               (int)(((char*)block - arena_of(block)) / block->size);
+    block->is_free = true;
+    lfUsers[arena].n.fetch_add(1);
+    lf_free_node(lfTree[arena], node, 0);
+    lfUsers[arena].n.fetch_sub(1);
+    if (lfTree[arena][1].load() == 0) lf_release_arena(arena);
+}
+
+// lf_walk: report the used blocks of a lock-free arena (best effort, see above)
+template <typename Fn>
+static bool lf_walk(int arena, int node, int order, Fn& fn)
+{
+    uint8_t value = lfTree[arena][node].load();
+    if (value & LF_OCC) {
+        MallocMetadata* block = node_block(arena, node, order);
+        return (block->order == order && !block->is_free) ? fn(block, *block) : true;
+    }
+    if (order == 0) return true;
+    return (!(value & LF_OCC_LEFT) || lf_walk(arena, 2 * node, order - 1, fn)) &&
+           (!(value & LF_OCC_RIGHT) || lf_walk(arena, 2 * node + 1, order - 1, fn));
+}
+
+// engine_alloc/engine_free: dispatch to a non-buddy engine
+static MallocMetadata* engine_alloc(SmallocEngine engine, size_t size)
+{
+    MallocMetadata* block = nullptr;
+    switch (engine) {
+    case SMALLOC_ENGINE_TLSF: block = tlsf_alloc(size); break;
+    case SMALLOC_ENGINE_TREE: block = tree_alloc(size); break;
+    case SMALLOC_ENGINE_LOCKFREE: block = lf_alloc(size); break;
+    default: break;
+    }
+    if (block) {
+        engineLiveBytes.fetch_add(block->size - sizeof(MallocMetadata), std::memory_order_relaxed);
+    }
+    return block;
+}
+
+static void engine_free(SmallocEngine engine, MallocMetadata* block)
+{
+    engineLiveBytes.fetch_sub(block->size - sizeof(MallocMetadata), std::memory_order_relaxed);
+    switch (engine) {
+    case SMALLOC_ENGINE_TLSF: tlsf_free(block); break;
+    case SMALLOC_ENGINE_TREE: tree_free(block); break;
+    case SMALLOC_ENGINE_LOCKFREE: lf_free(block); break;
+    default: break;
+    }
+}
+
+// --------------------------------------------------------------------------------
+// Shared-memory buddy heaps
+//   A second, self-contained buddy engine whose whole state lives inside one
+//   shared mapping (memfd_create or shm_open), so every attached process sees
+//   the same heap wherever it maps it:
+//     [ ShmHeader, padded to one page ][ region: N * 128KB ]
+//   Free lists are doubly linked through region offsets (+1, 0 = end) and are
+//   unsorted, so push/unlink are O(1). One PTHREAD_PROCESS_SHARED robust mutex
+//   guards a heap. If a process dies holding it, the next locker marks it
+//   consistent and carries on; a half-done split/merge may leak that block.
+//
+//   sshm_alloc hands out blocks; sfree accepts them from any attached process
+//   (it checks the attached ranges before touching a MallocMetadata header).
+//   Processes pass buffers around with sshm_offset/sshm_pointer.
+// --------------------------------------------------------------------------------
+static const int      MAX_SHARED_HEAPS = 16;
+static const uint32_t SHM_VERSION      = 1;
+static const size_t   SHM_HEADER       = 4096;
+
+struct ShmBlock {
+    uint64_t size;      // including this header
+    uint32_t order;
+    uint32_t is_free;
+    uint64_t next;      // region offset + 1 of the next free block, 0 = none
+    uint64_t prev;
+};
+
+struct ShmHeader {
+    char            magic[8];   // "SMALLOCS"
+    uint32_t        version;
+    uint32_t        ready;      // set last by the creator
+    uint64_t        regionSize;
+    pthread_mutex_t lock;
+    uint64_t        freeHead[MAX_ORDER + 1];
+    uint64_t        freeBlocks[MAX_ORDER + 1];
+    uint64_t        usedBlocks;
+    uint64_t        usedBytes;
+};
+static_assert(sizeof(ShmHeader) <= SHM_HEADER, "header must fit its page");
+
+struct SharedHeap {
+    ShmHeader* hdr;         // nullptr = slot unused
+    char*      region;
+    size_t     mapSize;
+    int        fd;
+};
+
+static SharedHeap          sharedHeaps[MAX_SHARED_HEAPS];
+static std::mutex          shared_lock;   // guards the slot table
+static std::atomic<int>    sharedAttached(0);
+
+static inline ShmBlock* shm_block(SharedHeap* h, uint64_t off)
+{
+    return off ? (ShmBlock*)(h->region + off - 1) : nullptr;
+}
+
+static inline uint64_t shm_off(SharedHeap* h, ShmBlock* b)
+{
+    return (uint64_t)((char*)b - h->region) + 1;
+}
+
+static void shm_push(SharedHeap* h, ShmBlock* b)
+{
+    uint64_t off = shm_off(h, b);
+    b->is_free = 1;
+    b->prev = 0;
+    b->next = h->hdr->freeHead[b->order];
+    if (b->next) shm_block(h, b->next)->prev = off;
+    h->hdr->freeHead[b->order] = off;
+    h->hdr->freeBlocks[b->order]++;
+}
+
+static void shm_unlink(SharedHeap* h, ShmBlock* b)
+{
+    if (b->prev) {
+        shm_block(h, b->prev)->next = b->next;
+    } else {
+        h->hdr->freeHead[b->order] = b->next;
+    }
+    if (b->next) shm_block(h, b->next)->prev = b->prev;
+    b->next = b->prev = 0;
+    b->is_free = 0;
+    h->hdr->freeBlocks[b->order]--;
+}
+
+static void shm_lock(SharedHeap* h)
+{
+    if (pthread_mutex_lock(&h->hdr->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&h->hdr->lock);
+    }
+}
+
+static void shm_unlock(SharedHeap* h)
+{
+    pthread_mutex_unlock(&h->hdr->lock);
+}
+
+// shm_map: map an fd and claim a slot; formats the heap if regionSize != 0
+static SharedHeap* shm_map(int fd, size_t regionSize)
+{
+    size_t mapSize = SHM_HEADER + regionSize;
+    if (regionSize == 0) {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size <= SHM_HEADER) return nullptr;
+        mapSize = (size_t)st.st_size;
+    }
+    void* map = mmap(nullptr, mapSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return nullptr;
+
+    ShmHeader* hdr = (ShmHeader*)map;
+    char* region = (char*)map + SHM_HEADER;
+    if (regionSize) {
+        memcpy(hdr->magic, "SMALLOCS", 8);
+        hdr->version    = SHM_VERSION;
+        hdr->regionSize = regionSize;
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&hdr->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+    } else if (memcmp(hdr->magic, "SMALLOCS", 8) != 0 || hdr->version != SHM_VERSION ||
+               !__atomic_load_n(&hdr->ready, __ATOMIC_ACQUIRE) ||
+               hdr->regionSize != mapSize - SHM_HEADER) {
+        munmap(map, mapSize);
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> guard(shared_lock);
+    for (int i = 0; i < MAX_SHARED_HEAPS; i++) {
+        SharedHeap* h = &sharedHeaps[i];
+        if (h->hdr) continue;
+        h->region  = region;
+        h->mapSize = mapSize;
+        h->fd      = fd;
+        if (regionSize) {
+            h->hdr = hdr;   // shm_push needs it
+            for (size_t off = 0; off < regionSize; off += BLOCK_SIZE) {
+                ShmBlock* b = (ShmBlock*)(region + off);
+                b->size  = BLOCK_SIZE;
+                b->order = MAX_ORDER;
+                shm_push(h, b);
+            }
+            __atomic_store_n(&hdr->ready, 1, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&h->hdr, hdr, __ATOMIC_RELEASE);
+        sharedAttached.fetch_add(1);
+        return h;
+    }
+    munmap(map, mapSize);
+    return nullptr;
+}
+
+// --------------------------------------------------------------------------------
+// sshm_create: new shared heap of `bytes` (rounded up to 128KB). With a name it
+//   is a POSIX shm object other processes can sshm_attach; without one it is an
+//   anonymous memfd, shared by fork or by passing sshm_fd over a socket.
+// --------------------------------------------------------------------------------
+SharedHeap* sshm_create(const char* name, size_t bytes)
+{
+    if (bytes == 0) return nullptr;
+    size_t regionSize = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    int fd = name ? shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)
+                  : memfd_create("smalloc-shared", MFD_CLOEXEC);
+    if (fd < 0) return nullptr;
+    if (ftruncate(fd, SHM_HEADER + regionSize) != 0) {
+        close(fd);
+        if (name) shm_unlink(name);
+        return nullptr;
+    }
+    SharedHeap* h = shm_map(fd, regionSize);
+    if (!h) {
+        close(fd);
+        if (name) shm_unlink(name);
+    }
+    return h;
+}
+
+SharedHeap* sshm_attach(const char* name)
+{
+    if (!name) return nullptr;
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) return nullptr;
+    SharedHeap* h = shm_map(fd, 0);
+    if (!h) close(fd);
+    return h;
+}
+
+// sshm_attach_fd: takes ownership of fd on success
+SharedHeap* sshm_attach_fd(int fd)
+{
+    return (fd < 0) ? nullptr : shm_map(fd, 0);
+}
+
+int sshm_fd(SharedHeap* h)
+{
+    return h ? h->fd : -1;
+}
+
+// sshm_detach: unmap in this process; the heap lives on in the others
+void sshm_detach(SharedHeap* h)
+{
+    if (!h || !h->hdr) return;
+    std::lock_guard<std::mutex> guard(shared_lock);
+    munmap(h->hdr, h->mapSize);
+    close(h->fd);
+    __atomic_store_n(&h->hdr, (ShmHeader*)nullptr, __ATOMIC_RELEASE);
+    h->region = nullptr;
+    sharedAttached.fetch_sub(1);
+}
+
+void* sshm_alloc(SharedHeap* h, size_t size)
+{
+    if (!h || !h->hdr || size == 0 || size + sizeof(ShmBlock) > BLOCK_SIZE) return nullptr;
+    int order = get_order(size + sizeof(ShmBlock));
+
+    shm_lock(h);
+    int i = order;
+    while (i <= MAX_ORDER && !h->hdr->freeHead[i]) i++;
+    if (i > MAX_ORDER) {
+        shm_unlock(h);
+        return nullptr;
+    }
+    ShmBlock* b = shm_block(h, h->hdr->freeHead[i]);
+    shm_unlink(h, b);
+    while ((int)b->order > order) {
+        // split: keep the lower half, free the upper one
+        b->order--;
+        b->size /= 2;
+        ShmBlock* upper = (ShmBlock*)((char*)b + b->size);
+        upper->size  = b->size;
+        upper->order = b->order;
+        shm_push(h, upper);
+    }
+    h->hdr->usedBlocks++;
+    h->hdr->usedBytes += b->size;
+    shm_unlock(h);
+    return (char*)b + sizeof(ShmBlock);
+}
+
+// shm_owner: the attached heap whose region holds p, if any
+static SharedHeap* shm_owner(const void* p)
+{
+    for (int i = 0; i < MAX_SHARED_HEAPS; i++) {
+        SharedHeap* h = &sharedHeaps[i];
+        if (!__atomic_load_n(&h->hdr, __ATOMIC_ACQUIRE)) continue;
+        if ((const char*)p >= h->region && (const char*)p < h->region + h->hdr->regionSize) {
+            return h;
+        }
+    }
+    return nullptr;
+}
+
+static void shm_free(SharedHeap* h, void* p)
+{
+    ShmBlock* b = (ShmBlock*)((char*)p - sizeof(ShmBlock));
+    shm_lock(h);
+    if (b->is_free) {
+        shm_unlock(h);
+        return;
+    }
+    h->hdr->usedBlocks--;
+    h->hdr->usedBytes -= b->size;
+    while (b->order < (uint32_t)MAX_ORDER) {
+        uint64_t off = (uint64_t)((char*)b - h->region);
+        ShmBlock* buddy = (ShmBlock*)(h->region + (off ^ b->size));
+        if (!buddy->is_free || buddy->order != b->order) break;
+        shm_unlink(h, buddy);
+        if (buddy < b) b = buddy;
+        b->order++;
+        b->size *= 2;
+    }
+    shm_push(h, b);
+    shm_unlock(h);
+}
+
+// offsets are region-relative + 1 so that 0 can stand for nullptr
+uint64_t sshm_offset(SharedHeap* h, const void* p)
+{
+    return (h && p) ? (uint64_t)((const char*)p - h->region) + 1 : 0;
+}
+
+void* sshm_pointer(SharedHeap* h, uint64_t offset)
+{
+    return (h && offset) ? h->region + (offset - 1) : nullptr;
+}
+
+// shm_usable_size: payload bytes of a block from a shared heap
+static size_t shm_usable_size(void* p)
+{
+    return ((ShmBlock*)((char*)p - sizeof(ShmBlock)))->size - sizeof(ShmBlock);
+}
+
+// --------------------------------------------------------------------------------
+// sring_alloc: circular buffer whose bytes can be read straight across the end
+//   size is rounded up to whole pages. One memfd is mapped twice back to back,
+//   right after a private header page whose tail holds the MallocMetadata:
+//     [ header page ][ view 1: ring ][ view 2: same pages again ]
+//   so p[i] and p[i + size] are the same byte for i < size. The block sits in
+//   mmapList with order RING_ORDER; sfree unmaps the header and both views.
+//   srealloc of a ring returns an ordinary (single-mapped) block.
+// --------------------------------------------------------------------------------
+void* sring_alloc(size_t size)
+{
+    if (size == 0 || size > 100000000) return nullptr;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t ringSize = (size + page - 1) / page * page;
+    if (budgetEnabled.load(std::memory_order_relaxed) && !budget_admit(ringSize)) {
+        return nullptr;
+    }
+
+    int fd = memfd_create("smalloc-ring", MFD_CLOEXEC);
+    if (fd < 0) return nullptr;
+    if (ftruncate(fd, ringSize) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    // reserve the whole span first so both views land where we want them
+    char* base = (char*)mmap(nullptr, page + 2 * ringSize, PROT_NONE,
+                             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+    }
+    bool ok = mprotect(base, page, PROT_READ|PROT_WRITE) == 0 &&
+              mmap(base + page, ringSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED,
+                   fd, 0) != MAP_FAILED &&
+              mmap(base + page + ringSize, ringSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED,
+                   fd, 0) != MAP_FAILED;
+    close(fd);   // the mappings keep the memfd alive
+    if (!ok) {
+        munmap(base, page + 2 * ringSize);
+        return nullptr;
+    }
+
+    MallocMetadata* block = (MallocMetadata*)(base + page - sizeof(MallocMetadata));
+    block->size    = ringSize + sizeof(MallocMetadata);
+    block->is_free = false;
+    block->is_mmap = true;
+    block->tag     = 0;
+    block->order   = RING_ORDER;
+    block->next    = nullptr;
+    block->prev    = nullptr;
+    SMALLOC_PROBE2(mmap_alloc, block->size, block);
+
+    std::lock_guard<std::mutex> guard(mmap_lock);
+    mmapList.addBlock(block);
+    return base + page;
+}
+
+// --------------------------------------------------------------------------------
+// sio_alloc: 4KB-aligned buffers in 4KB multiples, for O_DIRECT I/O
+//   A payload can't have a header in front of it and stay aligned, so the pool
+//   takes whole 128KB blocks ("slabs") from buddyArray and keeps them marked
+//   used. A slab's first page holds its MallocMetadata plus the out-of-band
+//   bookkeeping for the 31 pages behind it, which are carved into buffers of
+//   1, 2, 4, 8 or 16 pages. Free buffers wait on one freelist per size,
+//   linked through their own first word, so a recycled buffer costs one pop.
+//   Requests over 64KB are mmap'd behind a header page instead (order
+//   IO_ORDER in mmapList), which keeps them page aligned too.
+//   Free with sio_free. Pool buffers can't be srealloc'd or sfree'd;
+//   sio_pool_trim gives slabs with no buffer in use back to buddyArray.
+// --------------------------------------------------------------------------------
+static const size_t IO_PAGE       = MIN_BLOCK_SIZE << 5;     // 4KB, an order-5 block
+static const int    IO_CLASSES    = 5;                       // 1..16 pages
+static const int    IO_SLAB_PAGES = (int)(BLOCK_SIZE / IO_PAGE);
+static const uint8_t IO_NONE      = 0xFF;
+
+struct IoSlab {
+    MallocMetadata meta;                  // the slab's own (used) buddy header
+    uint8_t        cls[IO_SLAB_PAGES];    // class of the buffer starting at page i
+    uint8_t        busy[IO_SLAB_PAGES];   // 1 while that buffer is handed out
+};
+
+struct IoFreeList {
+    alignas(64) std::mutex m;
+    void* head = nullptr;
+};
+static IoFreeList ioFree[IO_CLASSES];
+
+static inline void io_push(int cls, void* buf)
+{
+    *(void**)buf = ioFree[cls].head;
+    ioFree[cls].head = buf;
+}
+
+// io_refill: carve a new slab, mostly into buffers of `cls`; the leftover
+// pages become smaller buffers so nothing but the header page is lost
+static bool io_refill(int cls)
+{
+    if (budgetEnabled.load(std::memory_order_relaxed) &&
+        !budget_admit(BLOCK_SIZE - sizeof(MallocMetadata))) {
+        return false;
+    }
+    IoSlab* slab = (IoSlab*)buddy_alloc_block(MAX_ORDER, false);
+    if (!slab) return false;
+    memset(slab->cls, IO_NONE, sizeof(slab->cls));
+    memset(slab->busy, 0, sizeof(slab->busy));
+
+    int page = 1;
+    for (int c = cls; c >= 0; c--) {
+        std::lock_guard<std::mutex> guard(ioFree[c].m);
+        for (; page + (1 << c) <= IO_SLAB_PAGES; page += 1 << c) {
+            slab->cls[page] = (uint8_t)c;
+            io_push(c, (char*)slab + page * IO_PAGE);
+        }
+    }
+    return true;
+}
+
+// io_alloc_large: page-aligned mmap behind a header page
+static void* io_alloc_large(size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = (size + page - 1) / page * page;
+    if (budgetEnabled.load(std::memory_order_relaxed) && !budget_admit(len)) {
+        return nullptr;
+    }
+    char* base = (char*)mmap(nullptr, page + len, PROT_READ|PROT_WRITE,
+                             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return nullptr;
+
+    MallocMetadata* block = (MallocMetadata*)(base + page - sizeof(MallocMetadata));
+    block->size    = len + sizeof(MallocMetadata);
+    block->is_free = false;
+    block->is_mmap = true;
+    block->tag     = 0;
+    block->order   = IO_ORDER;
+    block->next    = nullptr;
+    block->prev    = nullptr;
+    SMALLOC_PROBE2(mmap_alloc, block->size, block);
+
+    std::lock_guard<std::mutex> guard(mmap_lock);
+    mmapList.addBlock(block);
+    return base + page;
+}
+
+void* sio_alloc(size_t size)
+{
+    if (size == 0 || size > 100000000) return nullptr;
+    size_t pages = (size + IO_PAGE - 1) / IO_PAGE;
+    int cls = 0;
+    while (cls < IO_CLASSES && ((size_t)1 << cls) < pages) cls++;
+    if (cls == IO_CLASSES) return io_alloc_large(size);
+
+    if (!buddy_initialized.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> guard(init_lock);
+        if (!initialize_buddy_allocator()) return nullptr;
+    }
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> guard(ioFree[cls].m);
+            if (char* buf = (char*)ioFree[cls].head) {
+                ioFree[cls].head = *(void**)buf;
+                IoSlab* slab = (IoSlab*)(BASE + ((buf - BASE) & ~(BLOCK_SIZE - 1)));
+                slab->busy[(buf - (char*)slab) / IO_PAGE] = 1;
+                return buf;
+            }
+        }
+        if (!io_refill(cls)) return nullptr;
+    }
+}
+
+void sio_free(void* p)
+{
+    if (!p) return;
+    char* buf = (char*)p;
+    if (!BASE || buf < BASE || buf >= BASE + NUM_INIT_BLOCKS * BLOCK_SIZE) {
+        sfree(p);   // a large one
+        return;
+    }
+    IoSlab* slab = (IoSlab*)(BASE + ((buf - BASE) & ~(BLOCK_SIZE - 1)));
+    size_t offset = buf - (char*)slab;
+    int page = (int)(offset / IO_PAGE);
+    if (offset % IO_PAGE != 0 || page == 0 || slab->cls[page] == IO_NONE) {
+        std::cerr << "sio_free: " << p << " is not an I/O buffer\n";
+        return;
+    }
+    int cls = slab->cls[page];
+    std::lock_guard<std::mutex> guard(ioFree[cls].m);
+    if (!slab->busy[page]) return;
+    slab->busy[page] = 0;
+    io_push(cls, buf);
+}
+
+// --------------------------------------------------------------------------------
+// sio_pool_trim: return slabs whose buffers are all free; returns bytes freed
+// --------------------------------------------------------------------------------
+size_t sio_pool_trim()
+{
+    if (!buddy_initialized.load(std::memory_order_acquire)) return 0;
+    for (int c = 0; c < IO_CLASSES; c++) ioFree[c].m.lock();
+
+    // free pages per slab, then drop the buffers of the fully free ones
+    int freePages[NUM_INIT_BLOCKS] = {};
+    for (int c = 0; c < IO_CLASSES; c++) {
+        for (char* buf = (char*)ioFree[c].head; buf; buf = *(char**)buf) {
+            freePages[(buf - BASE) / BLOCK_SIZE] += 1 << c;
+        }
+    }
+    for (int c = 0; c < IO_CLASSES; c++) {
+        void** link = &ioFree[c].head;
+        while (*link) {
+            char* buf = (char*)*link;
+            if (freePages[(buf - BASE) / BLOCK_SIZE] == IO_SLAB_PAGES - 1) {
+                *link = *(void**)buf;
+            } else {
+                link = (void**)buf;
+            }
+        }
+    }
+    size_t released = 0;
+    for (int i = 0; i < NUM_INIT_BLOCKS; i++) {
+        if (freePages[i] == IO_SLAB_PAGES - 1) {
+            buddy_free_block((MallocMetadata*)(BASE + i * BLOCK_SIZE), false);
+            released += BLOCK_SIZE;
+        }
+    }
+
+    for (int c = IO_CLASSES - 1; c >= 0; c--) ioFree[c].m.unlock();
+    if (released && budgetEnabled.load(std::memory_order_relaxed)) {
+        budget_release();
+    }
+    return released;
+}
+
+// --------------------------------------------------------------------------------
+// smap_file: hand out an mmap of a file as an allocator-owned buffer
+//   The returned pointer is the file data itself, so the MallocMetadata can't
+//   sit in front of it: it lives out of band in a FileMapping and is linked
+//   into mmapList with order FILE_ORDER, so the mmap stats/budget see the
+//   mapping like any other mmap block. The records come from pages mapped for
+//   them (like CowBacking), not from smalloc, so they carry no tag, aren't
+//   charged to the budget and can't come from the real-time pool.
+//   offset must be page aligned (as for mmap), which makes the returned
+//   pointer page aligned too; sfree/srealloc only search the FileMapping list
+//   for page-aligned pointers, and only while one exists. sfree unmaps,
+//   srealloc mremaps (touching bytes past EOF still raises SIGBUS).
+// --------------------------------------------------------------------------------
+enum SmapFileFlags {
+    SMAP_WRITABLE = 1,   // PROT_WRITE; private copy-on-write unless SMAP_SHARED
+    SMAP_SHARED   = 2,   // MAP_SHARED: writes reach the file
+    SMAP_POPULATE = 4    // prefault the whole range
+};
+
+struct FileMapping {
+    MallocMetadata meta;     // out-of-band header, lives in mmapList
+    char*          data;     // what smap_file returned
+    size_t         mapLen;   // page-rounded mapping length
+    FileMapping*   nextMap;
+};
+
+static std::mutex       file_lock;   // guards fileMappings and fileSpare
+static FileMapping*     fileMappings = nullptr;
+static FileMapping*     fileSpare    = nullptr;   // unused records
+static std::atomic<int> fileMapCount(0);
+
+// file_mapping_new: a record off fileSpare, mapping a page of them if it's
+// empty; caller holds file_lock
+static FileMapping* file_mapping_new()
+{
+    if (!fileSpare) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        void* mem = mmap(nullptr, page, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return nullptr;
+        FileMapping* records = (FileMapping*)mem;
+        for (size_t i = 0; i < page / sizeof(FileMapping); i++) {
+            records[i].nextMap = fileSpare;
+            fileSpare = &records[i];
+        }
+    }
+    FileMapping* fm = fileSpare;
+    fileSpare = fm->nextMap;
+    return fm;
+}
+
+// file_mapping_release: caller holds file_lock
+static void file_mapping_release(FileMapping* fm)
+{
+    fm->nextMap = fileSpare;
+    fileSpare = fm;
+}
+
+static inline bool page_aligned(const void* p)
+{
+    return ((uintptr_t)p & ((uintptr_t)sysconf(_SC_PAGESIZE) - 1)) == 0;
+}
+
+// file_mapping_of: the FileMapping whose data starts at p, or nullptr
+static FileMapping* file_mapping_of(const void* p)
+{
+    if (fileMapCount.load(std::memory_order_relaxed) == 0 || !page_aligned(p)) return nullptr;
+    std::lock_guard<std::mutex> guard(file_lock);
+    for (FileMapping* fm = fileMappings; fm; fm = fm->nextMap) {
+        if (fm->data == p) return fm;
+    }
+    return nullptr;
+}
+
+void* smap_file(int fd, off_t offset, size_t len, int flags)
+{
+    if (fd < 0 || len == 0 || offset < 0 || !page_aligned((void*)(uintptr_t)offset)) {
+        return nullptr;
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapLen = (len + page - 1) / page * page;
+    if (budgetEnabled.load(std::memory_order_relaxed) && !budget_admit(len)) {
+        return nullptr;
+    }
+
+    FileMapping* fm;
+    {
+        std::lock_guard<std::mutex> guard(file_lock);
+        fm = file_mapping_new();
+    }
+    if (!fm) return nullptr;
+    int prot = PROT_READ | ((flags & SMAP_WRITABLE) ? PROT_WRITE : 0);
+    int mflags = ((flags & SMAP_SHARED) ? MAP_SHARED : MAP_PRIVATE) |
+                 ((flags & SMAP_POPULATE) ? MAP_POPULATE : 0);
+    void* data = mmap(nullptr, mapLen, prot, mflags, fd, offset);
+    if (data == MAP_FAILED) {
+        std::lock_guard<std::mutex> guard(file_lock);
+        file_mapping_release(fm);
+        return nullptr;
+    }
+
+    fm->meta.size    = len + sizeof(MallocMetadata);
+    fm->meta.is_free = false;
+    fm->meta.is_mmap = true;
+    fm->meta.tag     = 0;
+    fm->meta.order   = FILE_ORDER;
+    fm->meta.next    = nullptr;
+    fm->meta.prev    = nullptr;
+    fm->data         = (char*)data;
+    fm->mapLen       = mapLen;
+    SMALLOC_PROBE2(mmap_alloc, mapLen, data);
+    {
+        std::lock_guard<std::mutex> guard(mmap_lock);
+        mmapList.addBlock(&fm->meta);
+    }
+    std::lock_guard<std::mutex> guard(file_lock);
+    fm->nextMap = fileMappings;
+    fileMappings = fm;
+    fileMapCount.fetch_add(1);
+    return data;
+}
+
+static void file_unmap(FileMapping* fm)
+{
+    {
+        std::lock_guard<std::mutex> guard(file_lock);
+        FileMapping** link = &fileMappings;
+        while (*link != fm) link = &(*link)->nextMap;
+        *link = fm->nextMap;
+        fileMapCount.fetch_sub(1);
+    }
+    SMALLOC_PROBE2(mmap_free, fm->mapLen, fm->data);
+    {
+        std::lock_guard<std::mutex> guard(mmap_lock);
+        mmapList.removeBlock(&fm->meta);
+    }
+    munmap(fm->data, fm->mapLen);
+    std::lock_guard<std::mutex> guard(file_lock);
+    file_mapping_release(fm);
+}
+
+// file_remap: grow/shrink a file mapping in place or by moving it
+static void* file_remap(FileMapping* fm, size_t newLen)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t newMapLen = (newLen + page - 1) / page * page;
+    size_t oldLen = fm->meta.size - sizeof(MallocMetadata);
+    if (newLen > oldLen && budgetEnabled.load(std::memory_order_relaxed) &&
+        !budget_admit(newLen - oldLen)) {
+        return nullptr;
+    }
+    void* data = mremap(fm->data, fm->mapLen, newMapLen, MREMAP_MAYMOVE);
+    if (data == MAP_FAILED) return nullptr;
+
+    std::lock_guard<std::mutex> fguard(file_lock);
+    std::lock_guard<std::mutex> mguard(mmap_lock);
+    // size changes go through the list so its byte totals stay right
+    mmapList.removeBlock(&fm->meta);
+    fm->meta.size = newLen + sizeof(MallocMetadata);
+    mmapList.addBlock(&fm->meta);
+    fm->data   = (char*)data;
+    fm->mapLen = newMapLen;
+    return data;
+}
+
+// --------------------------------------------------------------------------------
+// Asynchronous free
+//   smalloc_set_async_free(depth) makes sfree push the pointer onto a bounded
+//   lock-free queue (Vyukov's MPMC ring: one CAS plus a store) and return; a
+//   background reclaimer thread runs the real sfree, so merging and munmap
+//   happen off the caller's thread. A full queue, or a free on the reclaimer
+//   itself, is done synchronously. The reclaimer polls every millisecond and
+//   is woken early once the queue is half full. An allocation that runs out
+//   of memory drains the queue on its own thread before anything else.
+//   smalloc_set_async_free(0) stops the reclaimer after draining the queue;
+//   afInFlight lets it wait out pushes that raced with the switch. The first
+//   start registers an atexit handler that does the same, so a process that
+//   exits with the reclaimer running doesn't destroy a joinable std::thread.
+// --------------------------------------------------------------------------------
+struct AsyncFreeSlot {
+    std::atomic<size_t> seq;
+    void*               p;
+};
+
+static std::atomic<bool>       afEnabled(false);
+static std::atomic<size_t>     afInFlight(0);
+static AsyncFreeSlot*          afQueue = nullptr;
+static size_t                  afMask  = 0;
+alignas(64) static std::atomic<size_t> afEnqueue(0);
+alignas(64) static std::atomic<size_t> afDequeue(0);
+static thread_local bool       onReclaimer = false;
+
+static std::mutex              af_lock;   // guards the settings and the thread below
+static std::condition_variable afWake;
+static std::thread             afThread;
+static bool                    afStop = false;
+static bool                    afAtexit = false;   // handler registered
+
+static bool async_free_push(void* p)
+{
+    size_t pos = afEnqueue.load(std::memory_order_relaxed);
+    AsyncFreeSlot* slot;
+    for (;;) {
+        slot = &afQueue[pos & afMask];
+        intptr_t diff = (intptr_t)slot->seq.load(std::memory_order_acquire) - (intptr_t)pos;
+        if (diff == 0) {
+            if (afEnqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return false;   // full
+        } else {
+            pos = afEnqueue.load(std::memory_order_relaxed);
+        }
+    }
+    slot->p = p;
+    slot->seq.store(pos + 1, std::memory_order_release);
+    if (((pos - afDequeue.load(std::memory_order_relaxed)) & afMask) == afMask / 2) {
+        afWake.notify_one();
+    }
+    return true;
+}
+
+static void* async_free_pop()
+{
+    size_t pos = afDequeue.load(std::memory_order_relaxed);
+    AsyncFreeSlot* slot;
+    for (;;) {
+        slot = &afQueue[pos & afMask];
+        intptr_t diff = (intptr_t)slot->seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (afDequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return nullptr;   // empty
+        } else {
+            pos = afDequeue.load(std::memory_order_relaxed);
+        }
+    }
+    void* p = slot->p;
+    slot->seq.store(pos + afMask + 1, std::memory_order_release);
+    return p;
+}
+
+// async_free_offer: sfree's fast path; false => free synchronously
+static inline bool async_free_offer(void* p)
+{
+    if (!afEnabled.load(std::memory_order_relaxed) || onReclaimer) return false;
+    afInFlight.fetch_add(1);
+    bool queued = afEnabled.load() && async_free_push(p);
+    afInFlight.fetch_sub(1, std::memory_order_release);
+    return queued;
+}
+
+// async_free_drain: free everything queued right now; returns how many
+static size_t async_free_drain()
+{
+    if (!afQueue) return 0;
+    bool was = onReclaimer;
+    onReclaimer = true;
+    size_t n = 0;
+    while (void* p = async_free_pop()) {
+        sfree(p);
+        n++;
+    }
+    onReclaimer = was;
+    return n;
+}
+
+static void async_free_stop()
+{
+    // caller holds af_lock
+    afEnabled.store(false);
+    while (afInFlight.load() != 0) std::this_thread::yield();
+    if (afThread.joinable()) {
+        afStop = true;
+        afWake.notify_all();
+        af_lock.unlock();
+        afThread.join();
+        af_lock.lock();
+    }
+    async_free_drain();
+}
+
+static void async_free_atexit()
+{
+    std::lock_guard<std::mutex> guard(af_lock);
+    async_free_stop();
+}
+
+// --------------------------------------------------------------------------------
+// smalloc_set_async_free: queue up to `depth` frees (rounded up to a power of
+//   two) for the reclaimer thread; 0 goes back to synchronous sfree
+// --------------------------------------------------------------------------------
+bool smalloc_set_async_free(size_t depth)
+{
+    std::lock_guard<std::mutex> guard(af_lock);
+    async_free_stop();
+    if (depth == 0) return true;
+
+    size_t capacity = 2;
+    while (capacity < depth) capacity <<= 1;
+    if (capacity != afMask + 1) {
+        size_t bytes = capacity * sizeof(AsyncFreeSlot);
+        void* mem = mmap(nullptr, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return false;
+        if (afQueue) munmap(afQueue, (afMask + 1) * sizeof(AsyncFreeSlot));
+        afQueue = (AsyncFreeSlot*)mem;
+        afMask = capacity - 1;
+    }
+    for (size_t i = 0; i <= afMask; i++) afQueue[i].seq.store(i, std::memory_order_relaxed);
+    afEnqueue.store(0);
+    afDequeue.store(0);
+
+    if (!afAtexit) {
+        // runs before afThread's destructor: registered after it was constructed
+        afAtexit = atexit(async_free_atexit) == 0;
+    }
+    afStop = false;
+    afThread = std::thread([]() {
+        onReclaimer = true;
+        std::unique_lock<std::mutex> lk(af_lock);
+        while (!afStop) {
+            lk.unlock();
+            while (void* p = async_free_pop()) sfree(p);
+            lk.lock();
+            afWake.wait_for(lk, std::chrono::milliseconds(1), [] { return afStop; });
+        }
+    });
+    afEnabled.store(true);
+    return true;
+}
+
+// --------------------------------------------------------------------------------
+// smalloc
+// --------------------------------------------------------------------------------
+// smalloc_once: one attempt; *outOfMemory tells an OOM apart from a refusal
+static void* smalloc_once(size_t size, bool* outOfMemory)
+{
+    *outOfMemory = false;
+    // first-time init
+    if (!buddy_initialized.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> guard(init_lock);
+        if (!initialize_buddy_allocator()) {
+            *outOfMemory = true;
+            return nullptr;
+        }
+    }
+
+    // If request >= 128KB => use mmap
+    if (size + sizeof(MallocMetadata) >= BLOCK_SIZE) {
+        if (budgetEnabled.load(std::memory_order_relaxed) && !budget_admit(size)) {
+            return nullptr;
+        }
+        MallocMetadata* block = allocate_with_mmap(size);
+        if (!block) {
+            *outOfMemory = true;
+            return nullptr;
+        }
+        // user ptr
+        return (char*)block + sizeof(MallocMetadata);
+    }
+
+    SmallocEngine engine = engine_for(size);
+    if (engine != SMALLOC_ENGINE_BUDDY) {
+        if (budgetEnabled.load(std::memory_order_relaxed) && !budget_admit(size)) {
+            return nullptr;
+        }
+        MallocMetadata* block = engine_alloc(engine, size);
+        if (!block) {
+            *outOfMemory = true;
+            return nullptr;
+        }
+        return (char*)block + sizeof(MallocMetadata);
+    }
+
+    // BUDDY logic
+    size_t needed = size + sizeof(MallocMetadata);
+    int order = get_order(needed);
+    if (order < 0 || order > MAX_ORDER) {
+        // can't handle
+        return nullptr;
+    }
+    if (budgetEnabled.load(std::memory_order_relaxed) &&
+        !budget_admit((MIN_BLOCK_SIZE << order) - sizeof(MallocMetadata))) {
+        return nullptr;
+    }
+
+    MallocMetadata* block;
+    if (order <= CACHE_MAX_ORDER && cache_mode.load(std::memory_order_relaxed) != SMALLOC_CACHE_OFF) {
+        block = cache_alloc(order);
+    } else {
+        block = buddy_alloc_block(order, false);
+    }
+    if (!block) {
+        // no suitable block found
+        *outOfMemory = true;
+        return nullptr;
+    }
+    return (char*)block + sizeof(MallocMetadata);
+}
+
+static void* smalloc_impl(size_t size)
+{
+    if (size == 0 || size > 100000000) {
+        return nullptr;
+    }
+    if (rtThread) {
+        if (void* p = rt_alloc(size)) return p;
+        rt_violation(size + sizeof(MallocMetadata) >= BLOCK_SIZE ? "mmap-sized request"
+                                                                 : "real-time pool exhausted",
+                     size);
+    }
+
+    bool outOfMemory;
+    void* p = smalloc_once(size, &outOfMemory);
+    if (p || !outOfMemory) return p;
+
+    // OOM => finish queued frees, ask the handler (unless we're already
+    // inside it), then the reserve
+    if (afEnabled.load(std::memory_order_relaxed)) {
+        // skip if the queue is being reconfigured
+        std::unique_lock<std::mutex> lk(af_lock, std::try_to_lock);
+        if (lk.owns_lock() && async_free_drain()) {
+            lk.unlock();
+            p = smalloc_once(size, &outOfMemory);
+            if (p || !outOfMemory) return p;
+        }
+    }
+    SmallocOomHandler handler;
+    while (!inOomHandler && (handler = oomHandler.load()) != nullptr) {
+        inOomHandler = true;
+        bool released = handler(size);
+        inOomHandler = false;
+        if (!released) break;
+        p = smalloc_once(size, &outOfMemory);
+        if (p || !outOfMemory) return p;
+    }
+    if (emergency_release()) {
+        p = smalloc_once(size, &outOfMemory);
+    }
+    return p;
+}
+
+// --------------------------------------------------------------------------------
+// Allocation tags
+//   Every used block carries a tag in its header (0 = untagged). smalloc uses
+//   the calling thread's current tag, smalloc_tagged an explicit one. Live
+//   bytes/blocks are kept per tag for tags 1..MAX_TAGS-1; larger tags are
+//   stored as 0. Untagged blocks cost nothing extra.
+// --------------------------------------------------------------------------------
+static const int MAX_TAGS = 256;
+
+static thread_local uint16_t currentTag = 0;
+static std::atomic<size_t>   tagLiveBytes[MAX_TAGS];
+static std::atomic<size_t>   tagLiveBlocks[MAX_TAGS];
+
+// smalloc_set_tag: returns the previous tag so callers can restore it
+uint16_t smalloc_set_tag(uint16_t tag)
+{
+    uint16_t prev = currentTag;
+    currentTag = tag;
+    return prev;
+}
+
+void* smalloc_tagged(size_t size, uint16_t tag)
+{
+    void* p = smalloc_impl(size);
+    if (!p) {
+        SMALLOC_PROBE3(smalloc, size, -1, p);   // p == nullptr: failed
+        return nullptr;
+    }
+    MallocMetadata* block = (MallocMetadata*)((char*)p - sizeof(MallocMetadata));
+    SMALLOC_PROBE3(smalloc, size, block->order, p);
+    block->tag = (tag < MAX_TAGS) ? tag : 0;
+    if (block->tag) {
+        tagLiveBytes[block->tag].fetch_add(block->size - sizeof(MallocMetadata),
+                                           std::memory_order_relaxed);
+        tagLiveBlocks[block->tag].fetch_add(1, std::memory_order_relaxed);
+    }
+    return p;
+}
+
+void* smalloc(size_t size)
+{
+    return smalloc_tagged(size, currentTag);
+}
+
+// --------------------------------------------------------------------------------
+// Parallel fill for giant buffers
+//   smalloc_set_parallel_fill(threshold, threads) starts `threads` workers;
+//   from then on scalloc/srealloc buffers of at least `threshold` bytes are
+//   set up in page-aligned chunks shared between the workers and the caller:
+//     - scalloc: an mmap block is fresh from the kernel and already zero, so
+//       it is only first-touched (one write per page), spreading the page
+//       faults over the workers and placing each page on the node of the
+//       thread that touched it. (Below the threshold it isn't touched at all.)
+//     - srealloc of an mmap block: the copy into the new block.
+//   One fill runs at a time; a second concurrent one does its own work on its
+//   own thread. threshold or threads of 0 stops the workers; so does an atexit
+//   handler registered by the first start, so a process that exits with the
+//   workers running doesn't destroy joinable std::threads.
+// --------------------------------------------------------------------------------
+static const unsigned MAX_FILL_THREADS = 64;
+static const size_t   FILL_MIN_CHUNK   = 256 * 1024;
+
+enum FillOp { FILL_TOUCH, FILL_COPY };
+
+struct FillJob {
+    FillOp              op;
+    char*               base;     // dst rounded down to a page
+    char*               dst;
+    const char*         src;
+    size_t              len;
+    size_t              chunk;
+    size_t              chunks;
+    std::atomic<size_t> next;
+    std::atomic<size_t> done;
+    unsigned            users;    // workers inside, guarded by fill_lock
+};
+
+static std::atomic<size_t>     fillThreshold(0);
+static std::mutex              fill_lock;          // guards everything below
+static std::mutex              fill_job_lock;      // one job at a time
+static std::condition_variable fillWake;
+static std::condition_variable fillDone;
+static std::thread             fillWorkers[MAX_FILL_THREADS];
+static unsigned                fillThreads = 0;
+static FillJob*                fillJob = nullptr;
+static uint64_t                fillGeneration = 0;
+static bool                    fillStop = false;
+static bool                    fillAtexit = false;   // handler registered, under fill_job_lock
+
+// fill_run: take chunks until none are left
+static void fill_run(FillJob* job)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for (;;) {
+        size_t i = job->next.fetch_add(1);
+        if (i >= job->chunks) return;
+        char* from = job->base + i * job->chunk;
+        char* to = from + job->chunk;
+        if (from < job->dst) from = job->dst;
+        if (to > job->dst + job->len) to = job->dst + job->len;
+        if (job->op == FILL_COPY) {
+            memcpy(from, job->src + (from - job->dst), to - from);
+        } else {
+            for (char* c = from; c < to; c += page) *(volatile char*)c = 0;
+        }
+        if (job->done.fetch_add(1) + 1 == job->chunks) {
+            std::lock_guard<std::mutex> guard(fill_lock);
+            fillDone.notify_all();
+        }
+    }
+}
+
+static void fill_worker()
+{
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lk(fill_lock);
+    for (;;) {
+        fillWake.wait(lk, [&] { return fillStop || fillGeneration != seen; });
+        if (fillStop) return;
+        seen = fillGeneration;
+        FillJob* job = fillJob;
+        if (!job) continue;
+        job->users++;
+        lk.unlock();
+        fill_run(job);
+        lk.lock();
+        if (--job->users == 0) fillDone.notify_all();
+    }
+}
+
+// parallel_fill: false if the pool is off, busy or the buffer too small
+static bool parallel_fill(FillOp op, char* dst, const char* src, size_t len)
+{
+    size_t threshold = fillThreshold.load(std::memory_order_relaxed);
+    if (!threshold || len < threshold) return false;
+    std::unique_lock<std::mutex> jobGuard(fill_job_lock, std::try_to_lock);
+    if (!jobGuard.owns_lock()) return false;
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    FillJob job;
+    job.op    = op;
+    job.base  = (char*)((uintptr_t)dst & ~(uintptr_t)(page - 1));
+    job.dst   = dst;
+    job.src   = src;
+    job.len   = len;
+    job.users = 0;
+    job.next.store(0);
+    job.done.store(0);
+    {
+        std::lock_guard<std::mutex> guard(fill_lock);
+        if (!fillThreads) return false;
+        // ~4 chunks per thread (workers + caller) for balance
+        size_t span = dst + len - job.base;
+        job.chunk = (span / ((fillThreads + 1) * 4) + page - 1) / page * page;
+        if (job.chunk < FILL_MIN_CHUNK) job.chunk = FILL_MIN_CHUNK;
+        job.chunks = (span + job.chunk - 1) / job.chunk;
+        fillJob = &job;
+        fillGeneration++;
+    }
+    fillWake.notify_all();
+    fill_run(&job);
+
+    std::unique_lock<std::mutex> lk(fill_lock);
+    fillDone.wait(lk, [&] { return job.done.load() == job.chunks && job.users == 0; });
+    fillJob = nullptr;
+    return true;
+}
+
+static void fill_stop_workers()
+{
+    // caller holds fill_job_lock, so no job is running
+    unsigned n;
+    {
+        std::lock_guard<std::mutex> guard(fill_lock);
+        fillStop = true;
+        n = fillThreads;
+        fillThreads = 0;
+    }
+    fillWake.notify_all();
+    for (unsigned i = 0; i < n; i++) fillWorkers[i].join();
+    std::lock_guard<std::mutex> guard(fill_lock);
+    fillStop = false;
+}
+
+static void parallel_fill_atexit()
+{
+    std::lock_guard<std::mutex> jobGuard(fill_job_lock);
+    fillThreshold.store(0);
+    fill_stop_workers();
+}
+
+// --------------------------------------------------------------------------------
+// smalloc_set_parallel_fill: use `threads` workers (at most MAX_FILL_THREADS)
+//   for scalloc/srealloc buffers of `threshold` bytes and up; 0 turns it off
+// --------------------------------------------------------------------------------
+void smalloc_set_parallel_fill(size_t threshold, unsigned threads)
+{
+    if (threads > MAX_FILL_THREADS) threads = MAX_FILL_THREADS;
+    std::lock_guard<std::mutex> jobGuard(fill_job_lock);
+    fillThreshold.store(0);
+    fill_stop_workers();
+    if (!threshold || !threads) return;
+
+    if (!fillAtexit) {
+        // runs before fillWorkers' destructors: registered after they were constructed
+        fillAtexit = atexit(parallel_fill_atexit) == 0;
+    }
+    {
+        std::lock_guard<std::mutex> guard(fill_lock);
+        for (unsigned i = 0; i < threads; i++) fillWorkers[i] = std::thread(fill_worker);
+        fillThreads = threads;
+    }
+    fillThreshold.store(threshold);
+}
+
+// --------------------------------------------------------------------------------
+// scalloc
+// --------------------------------------------------------------------------------
+void* scalloc(size_t num, size_t size)
+{
+    if (num == 0 || size == 0) return nullptr;
+    // check overflow
+    size_t totalSize = num * size;
+    if (size != 0 && (totalSize / size) != num) {
+        // overflow
+        return nullptr;
+    }
+    void* p = smalloc(totalSize);
+    if (!p) return nullptr;
+    MallocMetadata* block = (MallocMetadata*)((char*)p - sizeof(MallocMetadata));
+    if (block->is_mmap && (block->order == -1 || block->order == COW_ORDER)) {
+        // fresh pages from the kernel are already zero
+        parallel_fill(FILL_TOUCH, (char*)p, nullptr, totalSize);
+        return p;
+    }
+    memset(p, 0, totalSize);
+    return p;
+}
+
+// --------------------------------------------------------------------------------
+// sfree
+// --------------------------------------------------------------------------------
+void sfree(void* p)
+{
+    if (!p) return;
+    if (async_free_offer(p)) return;
+    if (sharedAttached.load(std::memory_order_relaxed) != 0) {
+        if (SharedHeap* h = shm_owner(p)) {
+            shm_free(h, p);
+            return;
+        }
+    }
+    if (FileMapping* fm = file_mapping_of(p)) {
+        file_unmap(fm);
+        return;
+    }
+    MallocMetadata* block = (MallocMetadata*)((char*)p - sizeof(MallocMetadata));
+    if (block->is_free || block->prev == CACHED_MARK) {
+        return;
+    }
+    SMALLOC_PROBE3(sfree, block->size - sizeof(MallocMetadata), block->order, p);
+    if (block->tag) {
+        tagLiveBytes[block->tag].fetch_sub(block->size - sizeof(MallocMetadata),
+                                           std::memory_order_relaxed);
+        tagLiveBlocks[block->tag].fetch_sub(1, std::memory_order_relaxed);
+        block->tag = 0;
+    }
+    if (!block->is_mmap && rt_owns(block)) {
+        // nothing else to update: the pool is outside buddyArray and the budget
+        rt_free(block);
+        return;
+    }
+    if (rtThread) {
+        rt_violation("sfree outside the real-time pool", block->size - sizeof(MallocMetadata));
+    }
+    SmallocEngine engine;
+    if (block->is_mmap) {
+        // free via mmap (still counted as used until it leaves mmapList)
+        free_mmap_block(block);
+    } else if ((engine = engine_of(block)) != SMALLOC_ENGINE_BUDDY) {
+        engine_free(engine, block);
+    } else if (block->prev == CACHE_LIVE_MARK) {
+        // buddy, handed out by the small-block caches
+        cache_free(block);
+    } else {
+        // buddy
+        buddy_free_block(block, false);
+    }
+    if (budgetEnabled.load(std::memory_order_relaxed)) {
+        budget_release();
+    }
+    if (reserveLow.load(std::memory_order_relaxed)) {
+        emergency_refill();
+    }
+
+#ifdef SMALLOC_HAVE_COROUTINES
+    // pairs with the fetch_add in SAsyncAlloc::await_suspend
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (asyncWaiters.load(std::memory_order_relaxed) != 0) {
+        async_wake_waiters();
+    }
+#endif
+}
+
+// --------------------------------------------------------------------------------
+// srealloc
+// --------------------------------------------------------------------------------
+void* srealloc(void* oldp, size_t newSize)
+{
+    SMALLOC_PROBE2(srealloc, oldp, newSize);
+    if (newSize == 0) {
+        sfree(oldp);
+        return nullptr;
+    }
+    if (!oldp) {
+        return smalloc(newSize);
+    }
+    if (sharedAttached.load(std::memory_order_relaxed) != 0) {
+        if (SharedHeap* h = shm_owner(oldp)) {
+            // stays in the same shared heap
+            size_t oldUserSize = shm_usable_size(oldp);
+            if (oldUserSize >= newSize) return oldp;
+            void* newp = sshm_alloc(h, newSize);
+            if (!newp) return nullptr;
+            memmove(newp, oldp, oldUserSize);
+            shm_free(h, oldp);
+            return newp;
+        }
+    }
+    if (FileMapping* fm = file_mapping_of(oldp)) {
+        return file_remap(fm, newSize);
+    }
+
+    MallocMetadata* oldBlock = (MallocMetadata*)((char*)oldp - sizeof(MallocMetadata));
+    size_t oldUserSize = oldBlock->size - sizeof(MallocMetadata);
+
+    if (oldUserSize >= newSize) {
+        // already big enough
+        return oldp;
+    }
+
+    // If it's mmap or not enough space => allocate new, copy, free old
+    if (oldBlock->is_mmap) {
+        // if same size, do nothing
+        if (oldUserSize == newSize) {
+            return oldp;
+        }
+        void* newp = smalloc_tagged(newSize, oldBlock->tag);
+        if (!newp) return nullptr;
+        size_t n = (oldUserSize < newSize) ? oldUserSize : newSize;
+        if (!parallel_fill(FILL_COPY, (char*)newp, (const char*)oldp, n)) {
+            memmove(newp, oldp, n);
+        }
+        sfree(oldp);
+        return newp;
+    } else {
+        // buddy block
+        // simplest approach: allocate new, copy, free old
+        // (You could try merging with buddy to expand in-place, if tests require it)
+        void* newp = smalloc_tagged(newSize, oldBlock->tag);
+        if (!newp) return nullptr;
+        memmove(newp, oldp, (oldUserSize < newSize) ? oldUserSize : newSize);
+        sfree(oldp);
+        return newp;
+    }
+}
+
+// --------------------------------------------------------------------------------
+// sclone: copy-on-write duplicate of an mmap-backed block
+//   Source and clone both end up as MAP_PRIVATE views of one memfd, so a page
+//   is only copied when one side writes it, and neither sees the other's
+//   writes. A block allocated in cow mode (smalloc_set_cow_mmap) that hasn't
+//   been cloned yet is cloned without copying. Any other mmap block - plain
+//   anonymous, or already cloned and maybe written since - is first copied
+//   into a new memfd once. Afterwards both are ordinary mmap blocks (order
+//   -1): sfree/srealloc as usual, and cloning them again copies.
+//   The clone keeps the source's size and tag. Buddy blocks, rings, file
+//   mappings and shared-heap blocks can't be cloned (nullptr).
+// --------------------------------------------------------------------------------
+void* sclone(void* p)
+{
+    if (!p) return nullptr;
+    if (sharedAttached.load(std::memory_order_relaxed) != 0 && shm_owner(p)) return nullptr;
+    if (file_mapping_of(p)) return nullptr;
+    MallocMetadata* block = (MallocMetadata*)((char*)p - sizeof(MallocMetadata));
+    if (block->is_free || !block->is_mmap || (block->order != -1 && block->order != COW_ORDER)) {
+        return nullptr;
+    }
+    size_t len = block->size;
+    size_t userSize = len - sizeof(MallocMetadata);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapLen = (len + page - 1) / page * page;
+    if (budgetEnabled.load(std::memory_order_relaxed) && !budget_admit(userSize)) {
+        return nullptr;
+    }
+
+    // the payload is copied into a new memfd before taking mmap_lock; only the
+    // header, whose list links may change meanwhile, is copied under it
+    bool  cow  = (block->order == COW_ORDER);
+    int   fd   = -1;
+    void* fill = MAP_FAILED;
+    if (!cow) {
+        fd = cow_memfd(len);
+        fill = (fd >= 0) ? mmap(nullptr, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)
+                         : MAP_FAILED;
+        if (fill == MAP_FAILED) {
+            if (fd >= 0) close(fd);
+            return nullptr;
+        }
+        memcpy((char*)fill + sizeof(MallocMetadata), p, userSize);
+    }
+
+    std::unique_lock<std::mutex> guard(mmap_lock);
+    CowBacking* cb = nullptr;
+    if (cow) {
+        cb = cow_unlink(block);
+        if (!cb) return nullptr;   // cloned by someone else meanwhile
+        fd = cb->fd;
+    } else {
+        memcpy(fill, block, sizeof(MallocMetadata));
+    }
+
+    // both private views first, then move one over the source in a single step
+    void* clone = mmap(nullptr, mapLen, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    void* view  = mmap(nullptr, mapLen, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    bool ok = clone != MAP_FAILED && view != MAP_FAILED &&
+              mremap(view, mapLen, mapLen, MREMAP_MAYMOVE|MREMAP_FIXED, block) != MAP_FAILED;
+    if (!ok) {
+        if (clone != MAP_FAILED) munmap(clone, mapLen);
+        if (view != MAP_FAILED) munmap(view, mapLen);
+        if (cb) {
+            // still MAP_SHARED, still cloneable
+            cb->nextBacking = cowBackings;
+            cowBackings = cb;
+        } else {
+            guard.unlock();
+            munmap(fill, len);
+            close(fd);
+        }
+        return nullptr;
+    }
+    block->order = -1;
+    if (cb) cow_backing_release(cb);
+
+    MallocMetadata* copy = (MallocMetadata*)clone;
+    copy->is_free = false;
+    copy->is_mmap = true;
+    copy->order   = -1;
+    copy->next    = nullptr;
+    copy->prev    = nullptr;
+    SMALLOC_PROBE2(mmap_alloc, len, clone);
+    mmapList.addBlock(copy);
+    guard.unlock();
+
+    if (fill != MAP_FAILED) munmap(fill, len);
+    close(fd);   // the views keep the memfd alive
+    if (copy->tag) {
+        tagLiveBytes[copy->tag].fetch_add(userSize, std::memory_order_relaxed);
+        tagLiveBlocks[copy->tag].fetch_add(1, std::memory_order_relaxed);
+    }
+    return (char*)clone + sizeof(MallocMetadata);
+}
+
+// --------------------------------------------------------------------------------
+// Epoch-based deferred free
+//   For lock-free structures whose readers may still hold an unlinked node:
+//   readers bracket their accesses with sepoch_enter/sepoch_exit (nestable),
+//   writers retire nodes with sfree_deferred instead of sfree. A retired block
+//   is freed once the global epoch has moved on twice since it was retired,
+//   i.e. once every thread that was inside back then has left. The epoch only
+//   advances when every thread currently inside has seen the current one.
+//   Each thread's record (grow-only registry, recycled at thread exit like the
+//   thread caches) keeps its retired pointers in chunks outside the blocks,
+//   one list per epoch mod 3, so readers never see a retired payload change.
+//   Every EPOCH_BATCH retires the thread tries to advance the epoch and frees
+//   whatever became safe in one go; the blocks take the normal sfree path, so
+//   small ones land in the caches and reach buddyArray in batches from there.
+//   sepoch_reclaim does the same on demand. A record left with retired blocks
+//   at thread exit hands them to the next thread that claims it. The exit-time
+//   collect may run after the thread's cache is gone; those frees skip the
+//   thread cache (see threadCacheGone).
+// --------------------------------------------------------------------------------
+static const size_t EPOCH_BATCH  = 64;   // retires between reclaim attempts
+static const size_t RETIRE_CHUNK = 58;   // keeps a RetireChunk at 480 bytes (order 2)
+
+struct RetireChunk {
+    RetireChunk* next;
+    size_t       count;
+    void*        ptrs[RETIRE_CHUNK];
+};
+
+struct alignas(64) EpochRecord {
+    std::atomic<uint64_t> local;            // (epoch << 1) | 1 while inside, else 0
+    unsigned              depth;            // owner-only from here on
+    uint64_t              retireEpoch[3];
+    RetireChunk*          retired[3];       // indexed by epoch % 3
+    size_t                retires;
+    std::atomic<bool>     in_use;
+    EpochRecord*          next;             // registry link, fixed once published
+};
+
+static std::atomic<uint64_t>     globalEpoch(0);
+static std::atomic<EpochRecord*> epochRegistry(nullptr);
+
+struct EpochRecordHandle {
+    EpochRecord* rec;
+    ~EpochRecordHandle();
+};
+static thread_local EpochRecordHandle epochRecord;
+static thread_local bool              epochRecordGone = false;   // like threadCacheGone
+
+// epoch_record_get: the caller's record, claimed or created on first use
+static EpochRecord* epoch_record_get()
+{
+    if (epochRecordGone) return nullptr;
+    if (epochRecord.rec) return epochRecord.rec;
+
+    for (EpochRecord* r = epochRegistry.load(std::memory_order_acquire); r; r = r->next) {
+        bool expected = false;
+        if (!r->in_use.load(std::memory_order_relaxed) &&
+            r->in_use.compare_exchange_strong(expected, true)) {
+            epochRecord.rec = r;
+            return r;
+        }
+    }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    void* mem = mmap(nullptr, page, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return nullptr;
+    EpochRecord* records = (EpochRecord*)mem;
+    size_t n = page / sizeof(EpochRecord);
+    for (size_t i = 0; i < n; i++) {
+        EpochRecord* r = new (&records[i]) EpochRecord();
+        r->in_use.store(i == 0, std::memory_order_relaxed);
+        r->next = epochRegistry.load(std::memory_order_relaxed);
+        while (!epochRegistry.compare_exchange_weak(r->next, r, std::memory_order_release,
+                                                    std::memory_order_relaxed)) {
+        }
+    }
+    epochRecord.rec = &records[0];
+    return epochRecord.rec;
+}
+
+void sepoch_enter()
+{
+    EpochRecord* r = epoch_record_get();
+    if (!r || r->depth++ != 0) return;
+    r->local.store((globalEpoch.load() << 1) | 1);
+    // the announcement must be visible before any shared pointer is read
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void sepoch_exit()
+{
+    EpochRecord* r = epochRecordGone ? nullptr : epochRecord.rec;
+    if (!r || r->depth == 0 || --r->depth != 0) return;
+    r->local.store(0, std::memory_order_release);
+}
+
+// epoch_try_advance: bump the epoch if every thread inside has seen it
+static uint64_t epoch_try_advance()
+{
+    uint64_t e = globalEpoch.load();
+    for (EpochRecord* r = epochRegistry.load(std::memory_order_acquire); r; r = r->next) {
+        uint64_t l = r->local.load();
+        if ((l & 1) && (l >> 1) != e) return e;
+    }
+    globalEpoch.compare_exchange_strong(e, e + 1);
+    return globalEpoch.load();
+}
+
+static size_t epoch_free_slot(EpochRecord* r, int slot)
+{
+    size_t freed = 0;
+    RetireChunk* chunk = r->retired[slot];
+    r->retired[slot] = nullptr;
+    while (chunk) {
+        RetireChunk* next = chunk->next;
+        for (size_t i = 0; i < chunk->count; i++) sfree(chunk->ptrs[i]);
+        freed += chunk->count;
+        sfree(chunk);
+        chunk = next;
+    }
+    return freed;
+}
+
+// epoch_collect: free every slot retired at least two epochs ago
+static size_t epoch_collect(EpochRecord* r)
+{
+    uint64_t e = epoch_try_advance();
+    size_t freed = 0;
+    for (int slot = 0; slot < 3; slot++) {
+        if (r->retired[slot] && r->retireEpoch[slot] + 2 <= e) freed += epoch_free_slot(r, slot);
+    }
+    return freed;
+}
+
+void sfree_deferred(void* p)
+{
+    if (!p) return;
+    EpochRecord* r = epoch_record_get();
+    if (!r) {
+        std::cerr << "sfree_deferred: no epoch record, leaking " << p << "\n";
+        return;
+    }
+    uint64_t e = globalEpoch.load();
+    int slot = (int)(e % 3);
+    if (r->retired[slot] && r->retireEpoch[slot] != e) {
+        // left over from epoch e - 3 or earlier: long safe
+        epoch_free_slot(r, slot);
+    }
+    RetireChunk* chunk = r->retired[slot];
+    if (!chunk || chunk->count == RETIRE_CHUNK) {
+        chunk = (RetireChunk*)smalloc(sizeof(RetireChunk));
+        if (!chunk) {
+            std::cerr << "sfree_deferred: out of memory, leaking " << p << "\n";
+            return;
+        }
+        chunk->next = r->retired[slot];
+        chunk->count = 0;
+        r->retired[slot] = chunk;
+    }
+    chunk->ptrs[chunk->count++] = p;
+    r->retireEpoch[slot] = e;
+    if (++r->retires % EPOCH_BATCH == 0) epoch_collect(r);
+}
+
+// --------------------------------------------------------------------------------
+// sepoch_reclaim: try to advance the epoch and free the caller's safe blocks
+//   returns how many retired blocks were freed
+// --------------------------------------------------------------------------------
+size_t sepoch_reclaim()
+{
+    EpochRecord* r = epoch_record_get();
+    return r ? epoch_collect(r) : 0;
+}
+
+EpochRecordHandle::~EpochRecordHandle()
+{
+    epochRecordGone = true;
+    if (!rec) return;
+    rec->depth = 0;
+    rec->local.store(0, std::memory_order_release);
+    epoch_collect(rec);
+    rec->in_use.store(false, std::memory_order_release);
+    rec = nullptr;
+}
+
+#ifdef SMALLOC_HAVE_COROUTINES
+// --------------------------------------------------------------------------------
+// sasync_alloc (C++20): `void* p = co_await sasync_alloc(size);`
+//   Buddy-sized requests that can't be served right now suspend the coroutine
+//   instead of returning nullptr. Waiters queue FIFO per order; sfree retries
+//   the queue heads once it has returned memory and resumes the ones it could
+//   satisfy, on the freeing thread. Requests that go to mmap (or are invalid)
+//   never wait and resume with smalloc's result.
+//
+//   smalloc never runs under async_lock: on OOM it may call the handler, the
+//   reclaim callbacks or the async-free drain, any of which can sfree and so
+//   land in async_wake_waiters again. wakeGen closes the gap between a failed
+//   retry and the enqueue: every wake pass bumps it, and a waiter (or a head
+//   the waker couldn't serve) that sees it moved retries instead of sleeping.
+// --------------------------------------------------------------------------------
+class SAsyncAlloc {
+public:
+    explicit SAsyncAlloc(size_t bytes)
+        : size(bytes), result(nullptr), order(-1), next(nullptr) {}
+
+    bool await_ready()
+    {
+        result = smalloc(size);
+        if (result) return true;
+        order = async_order(size);
+        return order < 0;
+    }
+
+    // false => got memory after all, don't suspend
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        handle = h;
+        // announce before retrying: an sfree after our retry sees the waiter
+        asyncWaiters.fetch_add(1);
+        for (;;) {
+            uint64_t seen = wakeGen.load();
+            result = smalloc(size);
+            if (result) {
+                asyncWaiters.fetch_sub(1);
+                return false;
+            }
+            std::lock_guard<std::mutex> guard(async_lock);
+            if (wakeGen.load() != seen) continue;   // memory came back meanwhile
+            if (waitTails[order]) {
+                waitTails[order]->next = this;
+            } else {
+                waitHeads[order] = this;
+            }
+            waitTails[order] = this;
+            return true;
+        }
+    }
+
+    void* await_resume() { return result; }
+
+private:
+    friend void async_wake_waiters();
+
+    static int async_order(size_t size)
+    {
+        if (size == 0 || size + sizeof(MallocMetadata) >= BLOCK_SIZE) return -1;
+        return get_order(size + sizeof(MallocMetadata));
+    }
+
+    size_t                  size;
+    void*                   result;
+    int                     order;
+    SAsyncAlloc*            next;
+    std::coroutine_handle<> handle;
+
+    static std::mutex            async_lock;
+    static std::atomic<uint64_t> wakeGen;
+    static SAsyncAlloc*          waitHeads[MAX_ORDER + 1];
+    static SAsyncAlloc*          waitTails[MAX_ORDER + 1];
+};
+
+std::mutex            SAsyncAlloc::async_lock;
+std::atomic<uint64_t> SAsyncAlloc::wakeGen(0);
+SAsyncAlloc*          SAsyncAlloc::waitHeads[MAX_ORDER + 1];
+SAsyncAlloc*          SAsyncAlloc::waitTails[MAX_ORDER + 1];
+
+static thread_local bool inAsyncWake = false;
+
+SAsyncAlloc sasync_alloc(size_t size)
+{
+    return SAsyncAlloc(size);
+}
+
+// async_wake_waiters: called by sfree while asyncWaiters != 0. A head is
+// popped under async_lock and served outside it; if it still doesn't fit it
+// goes back to the front of its queue.
+void async_wake_waiters()
+{
+    if (inAsyncWake) {
+        // an sfree from inside our own smalloc: just tell the outer pass
+        SAsyncAlloc::wakeGen.fetch_add(1);
+        return;
+    }
+    inAsyncWake = true;
+    SAsyncAlloc* ready = nullptr;
+    SAsyncAlloc** readyTail = &ready;
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        // FIFO: stop at the first head that still doesn't fit
+        for (;;) {
+            SAsyncAlloc* w;
+            uint64_t seen;
+            {
+                std::lock_guard<std::mutex> guard(SAsyncAlloc::async_lock);
+                seen = SAsyncAlloc::wakeGen.fetch_add(1) + 1;
+                w = SAsyncAlloc::waitHeads[i];
+                if (!w) break;
+                SAsyncAlloc::waitHeads[i] = w->next;
+                if (!w->next) SAsyncAlloc::waitTails[i] = nullptr;
+                w->next = nullptr;
+            }
+            void* p;
+            for (;;) {
+                p = smalloc(w->size);
+                if (p) break;
+                std::lock_guard<std::mutex> guard(SAsyncAlloc::async_lock);
+                uint64_t now = SAsyncAlloc::wakeGen.load();
+                if (now == seen) {
+                    w->next = SAsyncAlloc::waitHeads[i];
+                    SAsyncAlloc::waitHeads[i] = w;
+                    if (!w->next) SAsyncAlloc::waitTails[i] = w;
+                    break;
+                }
+                seen = now;   // memory came back meanwhile => try again
+            }
+            if (!p) break;
+            w->result = p;
+            *readyTail = w;
+            readyTail = &w->next;
+            asyncWaiters.fetch_sub(1);
+        }
+    }
+    inAsyncWake = false;
+    // resume outside the lock; a resumed coroutine may free (and wake) again
+    while (ready) {
+        SAsyncAlloc* w = ready;
+        ready = ready->next;
+        w->handle.resume();
+    }
+}
+#endif
+
+// --------------------------------------------------------------------------------
+// write_all: full write() to an open fd, retrying on EINTR
+// --------------------------------------------------------------------------------
+static bool write_all(int fd, const char* p, size_t left)
+{
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        left -= (size_t)n;
+    }
+    return true;
+}
+
+// --------------------------------------------------------------------------------
+// Heap walker
+//   sheap_walk reports every buddy block (free and used) in address order from
+//   BASE, then every mmapList entry (its kind in .order). It holds all order
+//   locks (ascending), the engine locks and then mmap_lock while it runs, so
+//   the callback sees a consistent heap but must not call smalloc/sfree. The
+//   real-time pool is the exception: its rt_lock is only held while one pool
+//   top block's headers are copied out, and that top block is reported from
+//   the copy after the lock is dropped, so a slow callback never stalls a
+//   real-time thread. Blocks sitting in a cache or in the emergency reserve
+//   are reported as used. Returning false from the callback stops the walk.
+// --------------------------------------------------------------------------------
+enum SheapBlockState {
+    SHEAP_FREE = 0,
+    SHEAP_USED = 1,
+    SHEAP_MMAP = 2
+};
+
+struct SheapBlockInfo {
+    void*           address;   // block header
+    size_t          size;      // including metadata
+    int             order;     // -1 for mmap blocks, RING/FILE/COW/IO_ORDER for those kinds,
+                               // TLSF_ORDER for TLSF blocks in the region
+    SheapBlockState state;
+    uint16_t        tag;
+};
+
+typedef bool (*SheapWalkFn)(const SheapBlockInfo* info, void* ctx);
+
+// also holds the engines still, so their blocks inside the region are stable
+static void lock_all_orders()
+{
+    for (int i = 0; i <= MAX_ORDER; i++) buddyLocks[i].m.lock();
+    tlsf_lock.lock();
+    tree_lock.lock();
+}
+
+static void unlock_all_orders()
+{
+    tree_lock.unlock();
+    tlsf_lock.unlock();
+    for (int i = MAX_ORDER; i >= 0; i--) buddyLocks[i].m.unlock();
+}
+
+struct WalkCopy {
+    MallocMetadata* at;
+    MallocMetadata  hdr;
+};
+static WalkCopy walkCopy[BLOCK_SIZE / MIN_BLOCK_SIZE];   // guarded by the order locks
+
+// rt_walk_top: report a real-time pool top block from a copy of its headers
+// taken under rt_lock; caller holds every order lock
+template <typename Fn>
+static bool rt_walk_top(char* top, Fn& fn)
+{
+    size_t n = 0;
+    pthread_mutex_lock(&rt_lock);
+    for (char* runner = top; runner < top + BLOCK_SIZE; ) {
+        MallocMetadata* block = (MallocMetadata*)runner;
+        size_t size = block->size;
+        if (size < sizeof(MallocMetadata) || size > (size_t)(top + BLOCK_SIZE - runner)) break;
+        walkCopy[n].at  = block;
+        walkCopy[n].hdr = *block;
+        n++;
+        runner += size;
+    }
+    pthread_mutex_unlock(&rt_lock);
+    for (size_t i = 0; i < n; i++) {
+        if (!fn(walkCopy[i].at, walkCopy[i].hdr)) return false;
+    }
+    return true;
+}
+
+// walk_buddy_region: caller holds every order lock. fn(block, header) gets
+// the block's address and its header, which for pool blocks is a copy.
+template <typename Fn>
+static bool walk_buddy_region(Fn fn)
+{
+    char* end = BASE + NUM_INIT_BLOCKS * BLOCK_SIZE;
+    for (char* runner = BASE; runner < end; ) {
+        MallocMetadata* block = (MallocMetadata*)runner;
+        if ((runner - BASE) % BLOCK_SIZE == 0 && rt_owns(block)) {
+            // no top block joins the pool under the order locks; one that
+            // leaves meanwhile is entirely free, so its copy is still right
+            if (!rt_walk_top(runner, fn)) return false;
+            runner += BLOCK_SIZE;
+            continue;
+        }
+        SmallocEngine engine = engine_of(block);
+        if ((runner - BASE) % BLOCK_SIZE == 0 &&
+            (engine == SMALLOC_ENGINE_TREE || engine == SMALLOC_ENGINE_LOCKFREE)) {
+            // free space in a tree arena has no headers to step through
+            int arena = (int)((runner - BASE) / BLOCK_SIZE);
+            if (engine == SMALLOC_ENGINE_TREE ? !tree_walk(arena, 1, MAX_ORDER, fn)
+                                              : !lf_walk(arena, 1, MAX_ORDER, fn)) {
+                return false;
+            }
+            runner += BLOCK_SIZE;
+            continue;
+        }
+        size_t size = block->size;
+        if (size < sizeof(MallocMetadata) || size > (size_t)(end - runner)) {
+            // not a header we can step over => skip the rest of this top block
+            runner = BASE + ((runner - BASE) / BLOCK_SIZE + 1) * BLOCK_SIZE;
+            continue;
+        }
+        if (!fn(block, *block)) return false;
+        runner += size;
+    }
+    return true;
+}
+
+void sheap_walk(SheapWalkFn fn, void* ctx)
+{
+    if (!fn || !buddy_initialized.load(std::memory_order_acquire)) return;
+
+    bool more;
+    lock_all_orders();
+    more = walk_buddy_region([&](MallocMetadata* block, const MallocMetadata& hdr) {
+        SheapBlockInfo info = { block, hdr.size, hdr.order,
+                                hdr.is_free ? SHEAP_FREE : SHEAP_USED, hdr.tag };
+        return fn(&info, ctx);
+    });
+    unlock_all_orders();
+    if (!more) return;
+
+    std::lock_guard<std::mutex> guard(mmap_lock);
+    for (MallocMetadata* block = mmapList.head; block; block = block->next) {
+        // order tells plain mmap blocks (-1) from rings, file mappings, COW and I/O blocks
+        SheapBlockInfo info = { block, block->size, block->order, SHEAP_MMAP, block->tag };
+        if (!fn(&info, ctx)) return;
+    }
+}
+
+// --------------------------------------------------------------------------------
+// sheap_dump_occupancy: write one bitmap per 128KB top block to `path`
+//   bit i of a bitmap = 128-byte unit i of that top block belongs to a used
+//   block (header included). File layout, all little-endian:
+//     char[4] "SOCC", uint32 version=1, uint32 top blocks, uint32 units per
+//     top block, then top blocks * units/8 bytes of bitmap.
+//   Returns false if the heap isn't initialized or the file can't be written.
+// --------------------------------------------------------------------------------
+static const size_t UNITS_PER_TOP = BLOCK_SIZE / MIN_BLOCK_SIZE;
+
+bool sheap_dump_occupancy(const char* path)
+{
+    if (!path || !buddy_initialized.load(std::memory_order_acquire)) return false;
+
+    struct {
+        char     magic[4];
+        uint32_t version;
+        uint32_t topBlocks;
+        uint32_t unitsPerTop;
+        uint8_t  bits[NUM_INIT_BLOCKS * UNITS_PER_TOP / 8];
+    } out = { {'S', 'O', 'C', 'C'}, 1, NUM_INIT_BLOCKS, (uint32_t)UNITS_PER_TOP, {} };
+
+    lock_all_orders();
+    walk_buddy_region([&](MallocMetadata* block, const MallocMetadata& hdr) {
+        if (hdr.is_free) return true;
+        size_t first = ((char*)block - BASE) / MIN_BLOCK_SIZE;
+        size_t units = hdr.size / MIN_BLOCK_SIZE;
+        if (units >= 8 && first % 8 == 0 && units % 8 == 0) {
+            memset(out.bits + first / 8, 0xFF, units / 8);   // order >= 3 is byte aligned
+        } else {
+            for (size_t u = first; u < first + units; u++) {
+                out.bits[u / 8] |= (uint8_t)(1u << (u % 8));
+            }
+        }
+        return true;
+    });
+    unlock_all_orders();
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = write_all(fd, (const char*)&out, sizeof(out));
+    return (close(fd) == 0) && ok;
+}
+
+// --------------------------------------------------------------------------------
+// Heap snapshot / restore
+//   sheap_snapshot(path) writes the buddy region, every mmap block, the
+//   buddyArray/mmapList heads+stats and the state kept beside those lists:
+//   the real-time pool (its top blocks and free lists), the count of blocks the
+//   caches have handed out, and the per-tag live counters - a block that came
+//   from any of them is still freed through them after a restore.
+//   sheap_restore(path), called before the
+//   first smalloc of a fresh process, maps all of it back MAP_PRIVATE from the
+//   file at the *same* virtual addresses (MAP_FIXED_NOREPLACE, so nothing that
+//   already lives there is clobbered). Every raw pointer - list links and the
+//   application's own - is therefore valid again, and pages load lazily.
+//   File layout:
+//     page 0..1   : SnapshotHeader
+//     page 2..    : the buddy region
+//     then        : numMmap SnapshotMmapEntry records
+//     then        : each mmap block, page aligned
+//   Caches are purged first; blocks a cache or the emergency reserve holds
+//   at snapshot time come back as used. Heaps holding sring_alloc rings or
+//   smap_file mappings can't be snapshotted. Restore fails (and maps nothing) if
+//   any of the old address ranges is taken in the new process.
+// --------------------------------------------------------------------------------
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+static const uint32_t SNAPSHOT_VERSION = 2;
+static const size_t   SNAPSHOT_PAGE    = 4096;
+static const size_t   SNAPSHOT_HEADER  = 2 * SNAPSHOT_PAGE;
+
+struct SnapshotHeader {
+    char       magic[8];   // "SMALLOCP"
+    uint32_t   version;
+    uint32_t   metaDataSize;
+    uint64_t   base;
+    uint64_t   regionSize;
+    uint64_t   numMmap;
+    BlocksList buddy[MAX_ORDER + 1];
+    BlocksList mmap;
+    // state beside the lists
+    uint64_t   cacheDetached[CACHE_ORDERS];
+    uint64_t   cacheLiveBytes;
+    uint32_t   rtTopMask;
+    uint32_t   rtNonEmpty;
+    uint64_t   rtTopCount;
+    uint64_t   rtFree[MAX_ORDER + 1];
+    uint64_t   tagLiveBytes[MAX_TAGS];
+    uint64_t   tagLiveBlocks[MAX_TAGS];
+};
+static_assert(sizeof(SnapshotHeader) <= SNAPSHOT_HEADER, "header must fit its pages");
+
+struct SnapshotMmapEntry {
+    uint64_t addr;
+    uint64_t size;
+    uint64_t fileOffset;
+};
+
+static inline size_t page_round(size_t n)
+{
+    return (n + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE * SNAPSHOT_PAGE;
+}
+
+bool sheap_snapshot(const char* path)
+{
+    if (!path || !buddy_initialized.load(std::memory_order_acquire)) return false;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+
+    cache_purge_all();
+    lock_all_orders();
+    std::unique_lock<std::mutex> mmapGuard(mmap_lock);
+
+    SnapshotHeader hdr = SnapshotHeader();
+    memcpy(hdr.magic, "SMALLOCP", 8);
+    hdr.version      = SNAPSHOT_VERSION;
+    hdr.metaDataSize = sizeof(MallocMetadata);
+    hdr.base         = (uint64_t)(uintptr_t)BASE;
+    hdr.regionSize   = NUM_INIT_BLOCKS * BLOCK_SIZE;
+    hdr.numMmap      = mmapList.num_allocated_blocks;
+    bool ok = true;
+    for (MallocMetadata* b = mmapList.head; b; b = b->next) {
+        // rings, file mappings and memfd-backed blocks can't be re-created from a blob
+        if (b->order != -1) ok = false;
+    }
+    for (int i = 0; i < NUM_INIT_BLOCKS; i++) {
+        // nor can the other engines' state outside the region
+        if (topEngine[i].load() != SMALLOC_ENGINE_BUDDY) ok = false;
+    }
+    for (int i = 0; i <= MAX_ORDER; i++) hdr.buddy[i] = buddyArray[i];
+    hdr.mmap = mmapList;
+    for (int i = 0; i < CACHE_ORDERS; i++) hdr.cacheDetached[i] = cacheDetached[i].load();
+    hdr.cacheLiveBytes = cacheLiveBytes.load();
+
+    // the real-time pool is copied out under rt_lock, which isn't held for the
+    // write; the order locks keep top blocks from joining it meanwhile
+    char* rtCopy = nullptr;
+    size_t rtCopyBytes = (size_t)__builtin_popcount(rtTopMask.load()) * BLOCK_SIZE;
+    if (rtCopyBytes) {
+        void* mem = mmap(nullptr, rtCopyBytes, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) ok = false;
+        else rtCopy = (char*)mem;
+    }
+    if (rtCopy) {
+        pthread_mutex_lock(&rt_lock);
+        hdr.rtTopMask  = rtTopMask.load();
+        hdr.rtNonEmpty = rtNonEmpty;
+        hdr.rtTopCount = rtTopCount;
+        for (int i = 0; i <= MAX_ORDER; i++) hdr.rtFree[i] = (uint64_t)(uintptr_t)rtFree[i];
+        char* out = rtCopy;
+        for (uint32_t m = hdr.rtTopMask; m; m &= m - 1) {
+            memcpy(out, BASE + __builtin_ctz(m) * BLOCK_SIZE, BLOCK_SIZE);
+            out += BLOCK_SIZE;
+        }
+        pthread_mutex_unlock(&rt_lock);
+    }
+    for (int i = 0; i < MAX_TAGS; i++) {
+        hdr.tagLiveBytes[i]  = tagLiveBytes[i].load();
+        hdr.tagLiveBlocks[i] = tagLiveBlocks[i].load();
+    }
+
+    static const char pad[SNAPSHOT_HEADER] = {};
+    ok = ok && write_all(fd, (const char*)&hdr, sizeof(hdr)) &&
+              write_all(fd, pad, SNAPSHOT_HEADER - sizeof(hdr));
+    const char* copied = rtCopy;
+    for (int i = 0; ok && i < NUM_INIT_BLOCKS; i++) {
+        if ((hdr.rtTopMask >> i) & 1) {
+            ok = write_all(fd, copied, BLOCK_SIZE);
+            copied += BLOCK_SIZE;
+        } else {
+            ok = write_all(fd, BASE + i * BLOCK_SIZE, BLOCK_SIZE);
+        }
+    }
+    if (rtCopy) munmap(rtCopy, rtCopyBytes);
+
+    size_t tableEnd = SNAPSHOT_HEADER + hdr.regionSize + hdr.numMmap * sizeof(SnapshotMmapEntry);
+    size_t blobOffset = page_round(tableEnd);
+    for (MallocMetadata* b = mmapList.head; ok && b; b = b->next) {
+        SnapshotMmapEntry e = { (uint64_t)(uintptr_t)b, b->size, blobOffset };
+        ok = write_all(fd, (const char*)&e, sizeof(e));
+        blobOffset += page_round(b->size);
+    }
+    if (ok) ok = write_all(fd, pad, page_round(tableEnd) - tableEnd);
+    for (MallocMetadata* b = mmapList.head; ok && b; b = b->next) {
+        ok = write_all(fd, (const char*)b, b->size) &&
+             write_all(fd, pad, page_round(b->size) - b->size);
+    }
+
+    mmapGuard.unlock();
+    unlock_all_orders();
+    return (close(fd) == 0) && ok;
+}
+
+// map_fixed_from: map [addr, addr+len) from fd at `offset`; nullptr if the
+// range is taken (or the kernel ignored the fixed hint)
+static void* map_fixed_from(uint64_t addr, size_t len, int fd, size_t offset)
+{
+    void* want = (void*)(uintptr_t)addr;
+    void* got = mmap(want, len, PROT_READ|PROT_WRITE, MAP_PRIVATE | MAP_FIXED_NOREPLACE,
+                     fd, (off_t)offset);
+    if (got == MAP_FAILED) return nullptr;
+    if (got != want) {
+        munmap(got, len);
+        return nullptr;
+    }
+    return got;
+}
+
+bool sheap_restore(const char* path)
+{
+    if (!path) return false;
+    std::lock_guard<std::mutex> guard(init_lock);
+    if (buddy_initialized) return false;   // there is already a live heap
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    SnapshotHeader hdr;
+    SnapshotMmapEntry* table = nullptr;
+    size_t tableBytes = 0;
+    size_t mapped = 0;   // regions mapped so far: 0 = none, 1 = BASE, 1+i = mmap block i
+    bool ok = pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr) &&
+              memcmp(hdr.magic, "SMALLOCP", 8) == 0 && hdr.version == SNAPSHOT_VERSION &&
+              hdr.metaDataSize == sizeof(MallocMetadata) &&
+              hdr.regionSize == NUM_INIT_BLOCKS * BLOCK_SIZE;
+
+    if (ok && hdr.numMmap) {
+        // the table is read into an anonymous mapping: the heap isn't up yet
+        tableBytes = page_round(hdr.numMmap * sizeof(SnapshotMmapEntry));
+        void* mem = mmap(nullptr, tableBytes, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        table = (mem == MAP_FAILED) ? nullptr : (SnapshotMmapEntry*)mem;
+        size_t want = hdr.numMmap * sizeof(SnapshotMmapEntry);
+        ok = table && pread(fd, table, want, SNAPSHOT_HEADER + hdr.regionSize) == (ssize_t)want;
+    }
+    if (ok) {
+        ok = map_fixed_from(hdr.base, hdr.regionSize, fd, SNAPSHOT_HEADER) != nullptr;
+        if (ok) mapped = 1;
+    }
+    for (size_t i = 0; ok && i < hdr.numMmap; i++) {
+        ok = map_fixed_from(table[i].addr, page_round(table[i].size), fd,
+                            table[i].fileOffset) != nullptr;
+        if (ok) mapped++;
+    }
+
+    if (!ok) {
+        if (mapped >= 1) munmap((void*)(uintptr_t)hdr.base, hdr.regionSize);
+        for (size_t i = 0; i + 1 < mapped; i++) {
+            munmap((void*)(uintptr_t)table[i].addr, page_round(table[i].size));
+        }
+    } else {
+        BASE = (char*)(uintptr_t)hdr.base;
+        for (int i = 0; i <= MAX_ORDER; i++) buddyArray[i] = hdr.buddy[i];
+        mmapList = hdr.mmap;
+        for (int i = 0; i < CACHE_ORDERS; i++) cacheDetached[i].store(hdr.cacheDetached[i]);
+        cacheLiveBytes.store(hdr.cacheLiveBytes);
+        if (hdr.rtTopMask) {
+            std::lock_guard<std::mutex> rtGuard(rt_config_lock);
+            rt_lock_init();
+            for (int i = 0; i <= MAX_ORDER; i++) {
+                rtFree[i] = (MallocMetadata*)(uintptr_t)hdr.rtFree[i];
+            }
+            rtNonEmpty = hdr.rtNonEmpty;
+            rtTopCount = hdr.rtTopCount;
+            rtTopMask.store(hdr.rtTopMask);
+        }
+        for (int i = 0; i < MAX_TAGS; i++) {
+            tagLiveBytes[i].store(hdr.tagLiveBytes[i]);
+            tagLiveBlocks[i].store(hdr.tagLiveBlocks[i]);
+        }
+        buddy_initialized.store(true, std::memory_order_release);
+    }
+    if (table) munmap(table, tableBytes);
+    close(fd);
+    return ok;
+}
+
+// --------------------------------------------------------------------------------
+// Stats
+//  5) _num_free_blocks     = sum of free blocks
+//  6) _num_free_bytes      = sum of free block sizes minus metadata
+//  7) _num_allocated_blocks= sum of allocated blocks (free + used)
+//  8) _num_allocated_bytes = sum of allocated blocks' sizes minus metadata
+//  9) _num_meta_data_bytes = sum of metadata bytes for all blocks in the heap
+// 10) _size_meta_data      = sizeof(MallocMetadata)
+// 11) _num_tag_bytes/_num_tag_blocks = live payload bytes/blocks under one tag
+// 12) _tag_snapshot        = live bytes of tags [0..maxTags) in one pass
+//   Blocks the caches detached from buddyArray are added back in: all of them
+//   as allocated, the ones sitting idle in a cache also as free.
+// --------------------------------------------------------------------------------
+static inline size_t cache_payload(int order)
+{
+    return (MIN_BLOCK_SIZE << order) - sizeof(MallocMetadata);
+}
+
+size_t _num_free_blocks()
+{
+    size_t total = 0;
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        total += buddyArray[i].num_free_blocks;
+    }
+    for (int i = 0; i < CACHE_ORDERS; i++) {
+        total += cache_idle_blocks(i);
+    }
+    total += mmapList.num_free_blocks;
+    return total;
+}
+
+size_t _num_free_bytes()
+{
+    size_t total = 0;
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        total += buddyArray[i].num_free_bytes;
+    }
+    for (int i = 0; i < CACHE_ORDERS; i++) {
+        total += cache_idle_blocks(i) * cache_payload(i);
+    }
+    total += mmapList.num_free_bytes;
+    return total;
+}
+
+size_t _num_allocated_blocks()
+{
+    size_t total = 0;
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        total += buddyArray[i].num_allocated_blocks;
+    }
+    for (int i = 0; i < CACHE_ORDERS; i++) {
+        total += cacheDetached[i].load(std::memory_order_relaxed);
+    }
+    total += mmapList.num_allocated_blocks;
+    return total;
+}
+
+size_t _num_allocated_bytes()
+{
+    size_t total = 0;
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        total += buddyArray[i].num_allocated_bytes;
+    }
+    for (int i = 0; i < CACHE_ORDERS; i++) {
+        total += cacheDetached[i].load(std::memory_order_relaxed) * cache_payload(i);
+    }
+    total += mmapList.num_allocated_bytes;
+    return total;
+}
+
+size_t _num_meta_data_bytes()
+{
+    size_t total = 0;
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        total += buddyArray[i].num_meta_data_bytes;
+    }
+    for (int i = 0; i < CACHE_ORDERS; i++) {
+        total += cacheDetached[i].load(std::memory_order_relaxed) * sizeof(MallocMetadata);
+    }
+    total += mmapList.num_meta_data_bytes;
+    return total;
+}
+
+size_t _size_meta_data()
+{
+    return sizeof(MallocMetadata);
+}
+
+size_t _num_tag_bytes(uint16_t tag)
+{
+    return (tag < MAX_TAGS) ? tagLiveBytes[tag].load(std::memory_order_relaxed) : 0;
+}
+
+size_t _num_tag_blocks(uint16_t tag)
+{
+    return (tag < MAX_TAGS) ? tagLiveBlocks[tag].load(std::memory_order_relaxed) : 0;
+}
+
+// _tag_snapshot: fills bytesOut[i] for tags 0..maxTags-1 (tag 0 is always 0),
+// returns how many entries were written
+size_t _tag_snapshot(size_t* bytesOut, size_t maxTags)
+{
+    if (!bytesOut) return 0;
+    size_t n = (maxTags < (size_t)MAX_TAGS) ? maxTags : (size_t)MAX_TAGS;
+    for (size_t i = 0; i < n; i++) {
+        bytesOut[i] = tagLiveBytes[i].load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+// --------------------------------------------------------------------------------
+// Stats export
+//   smalloc_stats_export serializes one consistent snapshot (taken under all
+//   order locks and mmap_lock) as JSON or Prometheus text. Like snprintf it
+//   returns the length the full text needs, writes at most len-1 bytes and
+//   always NUL-terminates. smalloc_stats_write does the same into a file.
+//
+//   fragmentation = free bytes outside 128KB blocks / free bytes: 0 when all
+//   free memory is in whole top blocks, near 1 when it's scattered in small ones.
+//   Cache hits/misses are cumulative over the per-CPU and per-thread caches.
+// --------------------------------------------------------------------------------
+enum SmallocStatsFormat {
+    SMALLOC_STATS_JSON       = 0,
+    SMALLOC_STATS_PROMETHEUS = 1
+};
+
+struct StatsSnapshot {
+    uint64_t timestampMs;
+    size_t   freeBlocks[MAX_ORDER + 1];
+    size_t   usedBlocks[MAX_ORDER + 1];
+    size_t   freeBytes;
+    size_t   allocatedBytes;
+    size_t   metaDataBytes;
+    size_t   mmapBlocks;
+    size_t   mmapBytes;
+    double   fragmentation;
+    uint64_t cacheHits;
+    uint64_t cacheMisses;
+};
+
+static void take_stats_snapshot(StatsSnapshot* snap)
+{
+    memset(snap, 0, sizeof(*snap));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    snap->timestampMs = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+
+    size_t topFree = 0;
+    lock_all_orders();
+    {
+        std::lock_guard<std::mutex> guard(mmap_lock);
+        for (int i = 0; i <= MAX_ORDER; i++) {
+            snap->freeBlocks[i]   = buddyArray[i].num_free_blocks;
+            snap->usedBlocks[i]   = buddyArray[i].num_allocated_blocks - buddyArray[i].num_free_blocks;
+            snap->freeBytes      += buddyArray[i].num_free_bytes;
+            snap->allocatedBytes += buddyArray[i].num_allocated_bytes;
+            snap->metaDataBytes  += buddyArray[i].num_meta_data_bytes;
+        }
+        topFree               = buddyArray[MAX_ORDER].num_free_bytes;
+        snap->mmapBlocks      = mmapList.num_allocated_blocks;
+        snap->mmapBytes       = mmapList.num_allocated_bytes;
+        snap->allocatedBytes += mmapList.num_allocated_bytes;
+        snap->metaDataBytes  += mmapList.num_meta_data_bytes;
+    }
+    unlock_all_orders();
+    for (int i = 0; i < CACHE_ORDERS; i++) {
+        size_t detached = cacheDetached[i].load(std::memory_order_relaxed);
+        size_t idle     = cache_idle_blocks(i);
+        if (idle > detached) idle = detached;   // counts are read unlocked
+        snap->freeBlocks[i]  += idle;
+        snap->usedBlocks[i]  += detached - idle;
+        snap->freeBytes      += idle * cache_payload(i);
+        snap->allocatedBytes += detached * cache_payload(i);
+        snap->metaDataBytes  += detached * sizeof(MallocMetadata);
+    }
+    snap->fragmentation = snap->freeBytes ? (double)(snap->freeBytes - topFree) / snap->freeBytes
+                                          : 0.0;
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        snap->cacheHits   += cpuCaches[cpu].hits.load(std::memory_order_relaxed);
+        snap->cacheMisses += cpuCaches[cpu].misses.load(std::memory_order_relaxed);
+    }
+    for (ThreadCache* tc = cacheRegistry.load(std::memory_order_acquire); tc; tc = tc->next) {
+        snap->cacheHits   += tc->hits.load(std::memory_order_relaxed);
+        snap->cacheMisses += tc->misses.load(std::memory_order_relaxed);
+    }
+}
+
+// snprintf-style appender: keeps counting once the buffer is full
+struct StatsWriter {
+    char*  buf;
+    size_t len;
+    size_t used;
+
+    void put(const char* fmt, ...) __attribute__((format(printf, 2, 3)))
+    {
+        va_list args;
+        va_start(args, fmt);
+        size_t room = (used < len) ? len - used : 0;
+        int n = vsnprintf(room ? buf + used : nullptr, room, fmt, args);
+        va_end(args);
+        if (n > 0) used += (size_t)n;
+    }
+};
+
+static void format_json(StatsWriter& w, const StatsSnapshot& s)
+{
+    w.put("{\"timestamp_ms\":%llu,\"orders\":[", (unsigned long long)s.timestampMs);
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        w.put("%s{\"order\":%d,\"block_size\":%zu,\"free\":%zu,\"used\":%zu}",
+              i ? "," : "", i, MIN_BLOCK_SIZE << i, s.freeBlocks[i], s.usedBlocks[i]);
+    }
+    w.put("],\"mmap_blocks\":%zu,\"mmap_bytes\":%zu,\"free_bytes\":%zu,"
+          "\"allocated_bytes\":%zu,\"meta_data_bytes\":%zu,\"fragmentation\":%.4f,"
+          "\"cache_hits\":%llu,\"cache_misses\":%llu}\n",
+          s.mmapBlocks, s.mmapBytes, s.freeBytes, s.allocatedBytes, s.metaDataBytes,
+          s.fragmentation, (unsigned long long)s.cacheHits, (unsigned long long)s.cacheMisses);
+}
+
+static void format_prometheus(StatsWriter& w, const StatsSnapshot& s)
+{
+    w.put("# TYPE smalloc_buddy_free_blocks gauge\n");
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        w.put("smalloc_buddy_free_blocks{order=\"%d\"} %zu\n", i, s.freeBlocks[i]);
+    }
+    w.put("# TYPE smalloc_buddy_used_blocks gauge\n");
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        w.put("smalloc_buddy_used_blocks{order=\"%d\"} %zu\n", i, s.usedBlocks[i]);
+    }
+    w.put("# TYPE smalloc_mmap_blocks gauge\nsmalloc_mmap_blocks %zu\n", s.mmapBlocks);
+    w.put("# TYPE smalloc_mmap_bytes gauge\nsmalloc_mmap_bytes %zu\n", s.mmapBytes);
+    w.put("# TYPE smalloc_free_bytes gauge\nsmalloc_free_bytes %zu\n", s.freeBytes);
+    w.put("# TYPE smalloc_allocated_bytes gauge\nsmalloc_allocated_bytes %zu\n", s.allocatedBytes);
+    w.put("# TYPE smalloc_meta_data_bytes gauge\nsmalloc_meta_data_bytes %zu\n", s.metaDataBytes);
+    w.put("# TYPE smalloc_fragmentation_ratio gauge\nsmalloc_fragmentation_ratio %.4f\n",
+          s.fragmentation);
+    w.put("# TYPE smalloc_cache_hits_total counter\nsmalloc_cache_hits_total %llu\n",
+          (unsigned long long)s.cacheHits);
+    w.put("# TYPE smalloc_cache_misses_total counter\nsmalloc_cache_misses_total %llu\n",
+          (unsigned long long)s.cacheMisses);
+}
+
+static size_t format_stats(SmallocStatsFormat fmt, const StatsSnapshot& snap, char* buf, size_t len)
+{
+    StatsWriter w = { buf, len, 0 };
+    if (fmt == SMALLOC_STATS_PROMETHEUS) {
+        format_prometheus(w, snap);
+    } else {
+        format_json(w, snap);
+    }
+    if (len) buf[(w.used < len) ? w.used : len - 1] = '\0';
+    return w.used;
+}
+
+size_t smalloc_stats_export(SmallocStatsFormat fmt, char* buf, size_t len)
+{
+    StatsSnapshot snap;
+    take_stats_snapshot(&snap);
+    return format_stats(fmt, snap, buf, len);
+}
+
+static const size_t STATS_TEXT_MAX = 4096;   // both formats fit with room to spare
+
+static bool stats_write_fd(int fd, SmallocStatsFormat fmt)
+{
+    StatsSnapshot snap;
+    take_stats_snapshot(&snap);
+    char text[STATS_TEXT_MAX];
+    size_t n = format_stats(fmt, snap, text, sizeof(text));
+    if (n >= sizeof(text)) return false;
+    if (fmt == SMALLOC_STATS_PROMETHEUS) {
+        char stamp[64];
+        int m = snprintf(stamp, sizeof(stamp), "# sample timestamp_ms=%llu\n",
+                         (unsigned long long)snap.timestampMs);
+        if (!write_all(fd, stamp, (size_t)m)) return false;
+    }
+    return write_all(fd, text, n);
+}
+
+// smalloc_stats_write: replace `path` with one snapshot
+bool smalloc_stats_write(SmallocStatsFormat fmt, const char* path)
+{
+    if (!path) return false;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = stats_write_fd(fd, fmt);
+    return (close(fd) == 0) && ok;
+}
+
+// --------------------------------------------------------------------------------
+// Stats sampler
+//   A background thread appends one snapshot every intervalMs to a file: one
+//   JSON object per line, or a Prometheus block after a "# sample" comment.
+//   Only one sampler runs at a time; start fails while one is running. The
+//   first start registers smalloc_stats_stop_sampler with atexit, so exiting
+//   with the sampler running doesn't destroy a joinable std::thread.
+// --------------------------------------------------------------------------------
+static std::mutex              sampler_lock;
+static std::condition_variable samplerWake;
+static std::thread             samplerThread;
+static bool                    samplerStop = false;
+static bool                    samplerAtexit = false;   // under sampler_lock
+
+void smalloc_stats_stop_sampler();
+
+bool smalloc_stats_start_sampler(const char* path, unsigned intervalMs, SmallocStatsFormat fmt)
+{
+    if (!path || intervalMs == 0) return false;
+    std::lock_guard<std::mutex> guard(sampler_lock);
+    if (samplerThread.joinable()) return false;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    if (!samplerAtexit) {
+        // runs before samplerThread's destructor: registered after it was constructed
+        samplerAtexit = atexit(smalloc_stats_stop_sampler) == 0;
+    }
+    samplerStop = false;
+    samplerThread = std::thread([fd, intervalMs, fmt]() {
+        std::unique_lock<std::mutex> lk(sampler_lock);
+        while (!samplerStop) {
+            lk.unlock();
+            stats_write_fd(fd, fmt);
+            lk.lock();
+            samplerWake.wait_for(lk, std::chrono::milliseconds(intervalMs),
+                                 [] { return samplerStop; });
+        }
+        close(fd);
+    });
+    return true;
+}
+
+void smalloc_stats_stop_sampler()
+{
+    std::thread t;
+    {
+        std::lock_guard<std::mutex> guard(sampler_lock);
+        if (!samplerThread.joinable()) return;
+        samplerStop = true;
+        t = std::move(samplerThread);
+    }
+    samplerWake.notify_all();
+    t.join();
+}
+
+#ifdef SMALLOC_PERF_COUNTERS
+// --------------------------------------------------------------------------------
+// Hardware counters for benchmark scenarios (build with -DSMALLOC_PERF_COUNTERS)
+//   smalloc_perf_begin();  ...scenario doing `ops` operations...;
+//   smalloc_perf_end(ops, &r);  smalloc_perf_report("name", &r);
+//   A multithreaded scenario measures each thread's share and sums them with
+//   smalloc_perf_add.
+//
+//   Counters are opened per thread, user space only, one perf_event_open each
+//   so that a counter the CPU/VM/paranoia level refuses just reads as
+//   unavailable instead of failing the whole set. Multiplexed counts are
+//   scaled by time_enabled/time_running.
+// --------------------------------------------------------------------------------
+enum SmallocPerfCounter {
+    SMALLOC_PERF_CYCLES = 0,
+    SMALLOC_PERF_INSTRUCTIONS,
+    SMALLOC_PERF_L1D_MISSES,
+    SMALLOC_PERF_LLC_MISSES,
+    SMALLOC_PERF_DTLB_MISSES,
+    SMALLOC_PERF_BRANCH_MISSES,
+    SMALLOC_PERF_NUM_COUNTERS
+};
+
+struct SmallocPerfResult {
+    uint64_t ops;
+    bool     available[SMALLOC_PERF_NUM_COUNTERS];
+    uint64_t total[SMALLOC_PERF_NUM_COUNTERS];
+    double   perOp[SMALLOC_PERF_NUM_COUNTERS];
+};
+
+static const char* const perfCounterNames[SMALLOC_PERF_NUM_COUNTERS] = {
+    "cycles", "instructions", "L1d-misses", "LLC-misses", "dTLB-misses", "branch-misses"
+};
+
+static thread_local int  perfFds[SMALLOC_PERF_NUM_COUNTERS];
+static thread_local bool perfOpened = false;
+
+// closes the thread's counters when it exits, so per-thread scenarios in a
+// long benchmark don't run out of descriptors
+struct PerfFdsHandle {
+    ~PerfFdsHandle();
+};
+static thread_local PerfFdsHandle perfFdsHandle;
+
+PerfFdsHandle::~PerfFdsHandle()
+{
+    if (!perfOpened) return;
+    for (int i = 0; i < SMALLOC_PERF_NUM_COUNTERS; i++) {
+        if (perfFds[i] >= 0) close(perfFds[i]);
+    }
+}
+
+static uint64_t cache_event(uint64_t cache, uint64_t op, uint64_t result)
+{
+    return cache | (op << 8) | (result << 16);
+}
+
+static int perf_open(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = type;
+    attr.config         = config;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+static void perf_open_all()
+{
+    perfOpened = true;
+    (void)&perfFdsHandle;   // constructs it, so its destructor runs
+    perfFds[SMALLOC_PERF_CYCLES] =
+        perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    perfFds[SMALLOC_PERF_INSTRUCTIONS] =
+        perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    perfFds[SMALLOC_PERF_L1D_MISSES] =
+        perf_open(PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_L1D,
+                  PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+    perfFds[SMALLOC_PERF_LLC_MISSES] =
+        perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    perfFds[SMALLOC_PERF_DTLB_MISSES] =
+        perf_open(PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_DTLB,
+                  PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+    perfFds[SMALLOC_PERF_BRANCH_MISSES] =
+        perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+}
+
+// smalloc_perf_begin: false if no counter at all could be opened
+bool smalloc_perf_begin()
+{
+    if (!perfOpened) perf_open_all();
+    bool any = false;
+    for (int i = 0; i < SMALLOC_PERF_NUM_COUNTERS; i++) {
+        if (perfFds[i] < 0) continue;
+        ioctl(perfFds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(perfFds[i], PERF_EVENT_IOC_ENABLE, 0);
+        any = true;
+    }
+    return any;
+}
+
+void smalloc_perf_end(uint64_t ops, SmallocPerfResult* out)
+{
+    if (!out) return;
+    memset(out, 0, sizeof(*out));
+    out->ops = ops;
+    for (int i = 0; i < SMALLOC_PERF_NUM_COUNTERS; i++) {
+        if (!perfOpened || perfFds[i] < 0) continue;
+        ioctl(perfFds[i], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t v[3];   // value, time_enabled, time_running
+        if (read(perfFds[i], v, sizeof(v)) != (ssize_t)sizeof(v) || v[2] == 0) continue;
+        out->available[i] = true;
+        out->total[i]     = (v[2] < v[1]) ? (uint64_t)((double)v[0] * v[1] / v[2]) : v[0];
+        out->perOp[i]     = ops ? (double)out->total[i] / ops : 0.0;
+    }
+}
+
+// smalloc_perf_add: fold `r` into `sum` (zeroed before the first call); a
+// counter stays available only if every part had it
+void smalloc_perf_add(SmallocPerfResult* sum, const SmallocPerfResult* r)
+{
+    if (!sum || !r) return;
+    bool first = sum->ops == 0;
+    sum->ops += r->ops;
+    for (int i = 0; i < SMALLOC_PERF_NUM_COUNTERS; i++) {
+        sum->available[i] = r->available[i] && (first || sum->available[i]);
+        sum->total[i]    += r->total[i];
+        sum->perOp[i]     = sum->ops ? (double)sum->total[i] / sum->ops : 0.0;
+    }
+}
+
+void smalloc_perf_report(const char* scenario, const SmallocPerfResult* r)
+{
+    if (!r) return;
+    std::cout << (scenario ? scenario : "scenario") << " (" << r->ops << " ops)";
+    bool any = false;
+    for (int i = 0; i < SMALLOC_PERF_NUM_COUNTERS; i++) {
+        if (!r->available[i]) continue;
+        std::cout << "  " << perfCounterNames[i] << "/op=" << r->perOp[i];
+        any = true;
+    }
+    if (!any) std::cout << "  [hardware counters unavailable]";
+    std::cout << "\n";
 }
+#endif
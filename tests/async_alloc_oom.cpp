@@ -0,0 +1,74 @@
+// A coroutine waits in sasync_alloc while the heap is full. The sfree that
+// wakes it runs smalloc for the waiter, which calls the OOM handler, which
+// frees memory itself and so re-enters the wake path. That used to deadlock
+// on async_lock; now the waiter is served once the handler made room.
+//   g++ -std=c++20 -O2 -pthread tests/async_alloc_oom.cpp -o async_alloc_oom
+#include "../forme.cpp"
+
+#include <cassert>
+#include <coroutine>
+#include <cstdio>
+#include <unistd.h>
+
+struct Task {
+    struct promise_type {
+        Task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() {}
+    };
+};
+
+static const size_t BIG = 100000;   // one 128KB top block
+
+static void* held[NUM_INIT_BLOCKS];
+static int   numHeld = 0;
+static bool  armed   = false;
+static int   handlerFrees = 0;
+static void* got = nullptr;
+
+static bool handler(size_t)
+{
+    if (!armed || numHeld == 0) return false;
+    sfree(held[--numHeld]);
+    handlerFrees++;
+    return true;
+}
+
+static Task waiter()
+{
+    got = co_await sasync_alloc(BIG);
+}
+
+int main()
+{
+    alarm(10);   // a deadlock fails the test instead of hanging it
+
+    // two small blocks share a top block, so freeing one can't make room for BIG
+    void* small1 = smalloc(100);
+    void* small2 = smalloc(100);
+    assert(small1 && small2);
+    while (void* p = smalloc(BIG)) {
+        assert(numHeld < NUM_INIT_BLOCKS);
+        held[numHeld++] = p;
+    }
+
+    set_oom_handler(handler);
+    waiter();
+    assert(!got);   // suspended
+    assert(asyncWaiters.load() == 1);
+
+    armed = true;
+    sfree(small1);   // wakes the waiter; its smalloc goes through the handler
+    assert(got);
+    assert(handlerFrees == 1);
+    assert(asyncWaiters.load() == 0);
+
+    set_oom_handler(nullptr);
+    sfree(got);
+    sfree(small2);
+    while (numHeld) sfree(held[--numHeld]);
+    printf("async_alloc_oom: ok\n");
+    return 0;
+}
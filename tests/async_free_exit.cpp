@@ -0,0 +1,17 @@
+// The process exits with the async-free reclaimer still running; the atexit
+// handler has to stop it before its std::thread is destroyed (which would
+// otherwise call std::terminate).
+//   g++ -std=c++17 -O2 -pthread tests/async_free_exit.cpp -o async_free_exit
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+
+int main()
+{
+    bool started = smalloc_set_async_free(64);
+    assert(started);
+    for (int i = 0; i < 1000; i++) sfree(smalloc(100));
+    printf("async_free_exit: ok\n");
+    return 0;   // reclaimer deliberately left running
+}
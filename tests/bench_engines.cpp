@@ -0,0 +1,74 @@
+// Buddy core versus the other allocation engines: throughput, and the payload
+// the heap charges at the peak relative to what was requested (power-of-two
+// rounding shows up here). "mixed" keeps a few hundred blocks of up to 8KB
+// live; "small" keeps thousands of small ones, so the buddy lists get long
+// while the tree engine's lookups stay logarithmic. Each run is followed by
+// its hardware counters per operation, where perf_event_open allows them.
+//   g++ -std=c++17 -O2 -pthread tests/bench_engines.cpp -o bench_engines
+#define SMALLOC_PERF_COUNTERS
+#include "../forme.cpp"
+
+#include <cstdio>
+
+static const int MAX_SLOTS = 8192;
+static const int ROUNDS    = 400000;
+
+static void* slot[MAX_SLOTS];
+static size_t len[MAX_SLOTS];
+
+static void run(const char* name, SmallocEngine engine, int slots, size_t maxSize)
+{
+    if (engine != SMALLOC_ENGINE_BUDDY) smalloc_set_engine_range(engine, 1, maxSize);
+    smalloc_set_limits(0, 0);
+
+    size_t requested = 0, peakRequested = 0, peakCharged = 0;
+    unsigned seed = 99;
+    struct timespec t0, t1;
+    smalloc_perf_begin();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int r = 0; r < ROUNDS; r++) {
+        seed = seed * 1103515245u + 12345u;
+        int s = (seed >> 8) % slots;
+        if (slot[s]) {
+            sfree(slot[s]);
+            requested -= len[s];
+            slot[s] = nullptr;
+        } else {
+            len[s] = 16 + (seed >> 12) % (maxSize - 16);
+            slot[s] = smalloc(len[s]);
+            if (!slot[s]) continue;
+            requested += len[s];
+            if (requested > peakRequested) {
+                peakRequested = requested;
+                peakCharged = smalloc_budget_usage();
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    SmallocPerfResult perf;
+    smalloc_perf_end(ROUNDS, &perf);
+    for (int s = 0; s < slots; s++) {
+        sfree(slot[s]);
+        slot[s] = nullptr;
+    }
+    if (engine != SMALLOC_ENGINE_BUDDY) smalloc_set_engine_range(engine, 1, 0);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%-6s %-8s %10.2f %14.3f\n", maxSize > 1000 ? "mixed" : "small", name,
+           ROUNDS / secs / 1e6,
+           peakRequested ? (double)peakCharged / peakRequested : 0.0);
+    printf("       ");
+    smalloc_perf_report(name, &perf);
+}
+
+int main()
+{
+    sfree(smalloc(1));
+    printf("load   engine       Mops/s   charged/req\n");
+    const SmallocEngine engines[] = { SMALLOC_ENGINE_BUDDY, SMALLOC_ENGINE_TLSF,
+                                      SMALLOC_ENGINE_TREE };
+    const char* names[] = { "buddy", "tlsf", "tree" };
+    for (int e = 0; e < 3; e++) run(names[e], engines[e], 512, 8000);
+    for (int e = 0; e < 3; e++) run(names[e], engines[e], 8192, 400);
+    return 0;
+}
@@ -0,0 +1,65 @@
+// Scalability of the lock-free engine from 1 to 64 threads, next to the
+// buddy core (caches off) and the mutex-based tree engine on the same load:
+// every thread allocates a batch of 64B..1KB blocks and frees it again.
+// Throughput is total operations per second; "per thread" divides it by the
+// thread count, so flat means linear scaling. The lock-free rows are followed
+// by their hardware counters per operation, summed over the threads, where
+// perf_event_open allows them.
+//   g++ -std=c++17 -O2 -pthread tests/bench_lockfree.cpp -o bench_lockfree
+#define SMALLOC_PERF_COUNTERS
+#include "../forme.cpp"
+
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+static const int OPS   = 100000;   // per thread
+static const int BATCH = 8;
+
+static void worker(int id, SmallocPerfResult* perf)
+{
+    void* batch[BATCH];
+    unsigned seed = 31u * (id + 1);
+    smalloc_perf_begin();
+    for (int i = 0; i < OPS / (2 * BATCH); i++) {
+        for (int j = 0; j < BATCH; j++) {
+            seed = seed * 1103515245u + 12345u;
+            batch[j] = smalloc(64 + (seed >> 8) % 960);
+        }
+        for (int j = 0; j < BATCH; j++) sfree(batch[j]);
+    }
+    smalloc_perf_end(OPS, perf);
+}
+
+static double run(SmallocEngine engine, int threads, SmallocPerfResult* sum)
+{
+    if (engine != SMALLOC_ENGINE_BUDDY) smalloc_set_engine_range(engine, 1, 1024);
+    struct timespec t0, t1;
+    std::vector<SmallocPerfResult> perf(threads);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    std::vector<std::thread> pool;
+    for (int i = 0; i < threads; i++) pool.emplace_back(worker, i, &perf[i]);
+    for (auto& t : pool) t.join();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    memset(sum, 0, sizeof(*sum));
+    for (int i = 0; i < threads; i++) smalloc_perf_add(sum, &perf[i]);
+    if (engine != SMALLOC_ENGINE_BUDDY) smalloc_set_engine_range(engine, 1, 0);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    return threads * (double)OPS / secs / 1e6;
+}
+
+int main()
+{
+    sfree(smalloc(1));
+    printf("threads   lockfree(Mops/s)  per thread   buddy(Mops/s)   tree(Mops/s)\n");
+    for (int threads = 1; threads <= 64; threads *= 2) {
+        SmallocPerfResult lfPerf, buddyPerf, treePerf;
+        double lf    = run(SMALLOC_ENGINE_LOCKFREE, threads, &lfPerf);
+        double buddy = run(SMALLOC_ENGINE_BUDDY, threads, &buddyPerf);
+        double tree  = run(SMALLOC_ENGINE_TREE, threads, &treePerf);
+        printf("%7d   %16.2f  %10.3f   %13.2f   %12.2f\n", threads, lf, lf / threads, buddy, tree);
+        printf("          ");
+        smalloc_perf_report("lockfree", &lfPerf);
+    }
+    return 0;
+}
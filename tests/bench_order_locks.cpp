@@ -0,0 +1,59 @@
+// Throughput of the buddy core with the caches off, at 1..8 threads. In the
+// "mixed" run each thread sticks to its own order, so with per-order locks the
+// threads mostly take different locks; "same" puts them all on order 2.
+// Each row is followed by the hardware counters per operation, summed over
+// the threads, where perf_event_open allows them.
+//   g++ -std=c++17 -O2 -pthread tests/bench_order_locks.cpp -o bench_order_locks
+#define SMALLOC_PERF_COUNTERS
+#include "../forme.cpp"
+
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+static const int OPS   = 200000;
+static const int BATCH = 16;
+
+static void worker(int order, SmallocPerfResult* perf)
+{
+    size_t size = (MIN_BLOCK_SIZE << order) - sizeof(MallocMetadata);
+    void* batch[BATCH];
+    smalloc_perf_begin();
+    for (int i = 0; i < OPS / BATCH; i++) {
+        for (int j = 0; j < BATCH; j++) batch[j] = smalloc(size);
+        for (int j = 0; j < BATCH; j++) sfree(batch[j]);
+    }
+    smalloc_perf_end(OPS, perf);
+}
+
+static double run(int threads, bool mixed, SmallocPerfResult* sum)
+{
+    struct timespec t0, t1;
+    std::vector<SmallocPerfResult> perf(threads);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    std::vector<std::thread> pool;
+    for (int i = 0; i < threads; i++) pool.emplace_back(worker, mixed ? i % 6 : 2, &perf[i]);
+    for (auto& t : pool) t.join();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    memset(sum, 0, sizeof(*sum));
+    for (int i = 0; i < threads; i++) smalloc_perf_add(sum, &perf[i]);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    return threads * (double)OPS / secs / 1e6;
+}
+
+int main()
+{
+    sfree(smalloc(1));
+    printf("threads   same(Mops/s)   mixed(Mops/s)\n");
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        SmallocPerfResult samePerf, mixedPerf;
+        double same  = run(threads, false, &samePerf);
+        double mixed = run(threads, true, &mixedPerf);
+        printf("%7d   %12.2f   %13.2f\n", threads, same, mixed);
+        printf("          ");
+        smalloc_perf_report("same", &samePerf);
+        printf("          ");
+        smalloc_perf_report("mixed", &mixedPerf);
+    }
+    return 0;
+}
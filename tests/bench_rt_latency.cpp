@@ -0,0 +1,103 @@
+// Worst-case latency of smalloc/sfree on a real-time thread over 1e8
+// operations (or argv[1]), once alone and once with another thread walking
+// the heap and dumping its occupancy the whole time. Latencies go into a
+// 1ns histogram up to 64us, so p99.99 and the maximum come out exact.
+//   g++ -std=c++17 -O2 -pthread tests/bench_rt_latency.cpp -o bench_rt_latency
+#include "../forme.cpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+static const int      SLOTS   = 64;
+static const uint32_t BUCKETS = 65536;
+
+static uint64_t histogram[BUCKETS];   // [BUCKETS - 1] collects everything longer
+static uint64_t maxNs;
+static std::atomic<bool> done(false);
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void rt_worker(uint64_t ops)
+{
+    smalloc_set_realtime(true);
+    void* slot[SLOTS] = {};
+    unsigned seed = 4242;
+    for (uint64_t r = 0; r < ops; r++) {
+        seed = seed * 1103515245u + 12345u;
+        int s = (seed >> 8) % SLOTS;
+        uint64_t t0 = now_ns();
+        if (slot[s]) {
+            sfree(slot[s]);
+            slot[s] = nullptr;
+        } else {
+            slot[s] = smalloc((size_t)64 << ((seed >> 16) % 8));
+        }
+        uint64_t ns = now_ns() - t0;
+        histogram[ns < BUCKETS ? ns : BUCKETS - 1]++;
+        if (ns > maxNs) maxNs = ns;
+    }
+    for (int s = 0; s < SLOTS; s++) sfree(slot[s]);
+    smalloc_set_realtime(false);
+    done.store(true);
+}
+
+static uint64_t percentile(uint64_t ops, double p)
+{
+    uint64_t want = (uint64_t)(ops * p), seen = 0;
+    for (uint32_t ns = 0; ns < BUCKETS; ns++) {
+        seen += histogram[ns];
+        if (seen > want) return ns;
+    }
+    return BUCKETS - 1;
+}
+
+static bool count_block(const SheapBlockInfo*, void* ctx)
+{
+    ++*(size_t*)ctx;
+    return true;
+}
+
+static void run(const char* name, uint64_t ops, bool walker)
+{
+    memset(histogram, 0, sizeof(histogram));
+    maxNs = 0;
+    done.store(false);
+    std::thread rt(rt_worker, ops);
+    size_t walks = 0;
+    while (walker && !done.load()) {
+        size_t blocks = 0;
+        sheap_walk(count_block, &blocks);
+        sheap_dump_occupancy("/dev/null");
+        walks++;
+    }
+    rt.join();
+    printf("%-8s %12llu %8llu %8llu %11llu %10llu %8zu\n", name, (unsigned long long)ops,
+           (unsigned long long)percentile(ops, 0.5), (unsigned long long)percentile(ops, 0.99),
+           (unsigned long long)percentile(ops, 0.9999), (unsigned long long)maxNs, walks);
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t ops = argc > 1 ? strtoull(argv[1], nullptr, 10) : 100000000ull;
+    sfree(smalloc(1));
+    if (!smalloc_rt_reserve(4)) {
+        fprintf(stderr, "bench_rt_latency: couldn't reserve the pool\n");
+        return 1;
+    }
+    printf("%-8s %12s %8s %8s %11s %10s %8s\n", "run", "ops", "p50(ns)", "p99(ns)",
+           "p99.99(ns)", "max(ns)", "walks");
+    run("alone", ops, false);
+    run("walked", ops, true);
+    if (smalloc_rt_violations() != 0) {
+        fprintf(stderr, "bench_rt_latency: %zu real-time violations\n", smalloc_rt_violations());
+        return 1;
+    }
+    smalloc_rt_reserve(0);
+    return 0;
+}
@@ -0,0 +1,46 @@
+// The hard limit also holds for blocks served by the small-block caches, and
+// blocks a cache handed out can still be freed after the caches are switched off.
+//   g++ -std=c++17 -O2 -pthread tests/budget_caches.cpp -o budget_caches
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+
+static const int    N     = 2048;
+static const size_t LIMIT = 64 * 1024;
+
+static void* ptrs[N];
+
+static void run(SmallocCacheMode mode)
+{
+    size_t freeBytes = _num_free_bytes();
+    smalloc_set_cache_mode(mode);
+    smalloc_set_limits(0, LIMIT);
+
+    int got = 0;
+    for (int i = 0; i < N; i++) {
+        ptrs[i] = smalloc(1000);
+        if (ptrs[i]) got++;
+    }
+    // 1000B needs a 1KB block: at most 64 of them fit under 64KB
+    assert(got > 0 && (size_t)got * 1000 <= LIMIT);
+    assert(smalloc_budget_usage() <= LIMIT);
+
+    // free half with the caches on, the rest after switching them off
+    for (int i = 0; i < N / 2; i++) sfree(ptrs[i]);
+    smalloc_set_cache_mode(SMALLOC_CACHE_OFF);
+    for (int i = N / 2; i < N; i++) sfree(ptrs[i]);
+
+    assert(smalloc_budget_usage() == 0);
+    assert(_num_free_bytes() == freeBytes);
+    smalloc_set_limits(0, 0);
+}
+
+int main()
+{
+    sfree(smalloc(1));
+    run(SMALLOC_CACHE_PER_THREAD);
+    run(SMALLOC_CACHE_PER_CPU);
+    printf("budget_caches: ok\n");
+    return 0;
+}
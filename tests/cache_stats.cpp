@@ -0,0 +1,50 @@
+// Cached small blocks stay in the _num_* stats and a double sfree of one is
+// caught instead of pushing it onto a cache twice.
+//   g++ -std=c++17 -O2 -pthread tests/cache_stats.cpp -o cache_stats && ./cache_stats
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+
+static const int N = 2048;
+static void* ptrs[N];
+
+static void run(SmallocCacheMode mode)
+{
+    size_t allocated = _num_allocated_blocks();
+    size_t freeBlocks = _num_free_blocks();
+
+    smalloc_set_cache_mode(mode);
+    for (int i = 0; i < N; i++) {
+        ptrs[i] = smalloc(1000);
+        assert(ptrs[i]);
+    }
+    // every live block is counted, wherever it came from
+    assert(_num_allocated_blocks() - _num_free_blocks() >= (size_t)N);
+    assert(_num_allocated_bytes() - _num_free_bytes() >= (size_t)N * 1000);
+
+    for (int i = 0; i < N; i++) sfree(ptrs[i]);
+
+    // a second sfree of a cached block is a no-op
+    void* p = smalloc(1000);
+    sfree(p);
+    sfree(p);
+    void* a = smalloc(1000);
+    void* b = smalloc(1000);
+    assert(a != b);
+    sfree(a);
+    sfree(b);
+
+    smalloc_set_cache_mode(SMALLOC_CACHE_OFF);
+    assert(_num_allocated_blocks() == allocated);
+    assert(_num_free_blocks() == freeBlocks);
+}
+
+int main()
+{
+    sfree(smalloc(1));   // initialize the heap
+    run(SMALLOC_CACHE_PER_THREAD);
+    run(SMALLOC_CACHE_PER_CPU);
+    printf("cache_stats: ok\n");
+    return 0;
+}
@@ -0,0 +1,118 @@
+// Per-thread caches: a thread that misses robs a peer hoarding blocks of that
+// order instead of going to buddyArray, and the scavenger keeps the blocks
+// held across all caches under CACHE_TOTAL_LIMIT while their owners are
+// active, then drains caches whose owners went idle.
+//   g++ -std=c++17 -O2 -pthread tests/cache_steal.cpp -o cache_steal
+#include "../forme.cpp"
+
+#include <cassert>
+#include <condition_variable>
+#include <cstdio>
+#include <set>
+#include <thread>
+#include <vector>
+
+static std::mutex              lock;
+static std::condition_variable cv;
+static int                     allocated = 0;
+static int                     filled = 0;
+static int                     threadsInRun = 0;
+static bool                    release = false;
+
+static long cached_bytes()
+{
+    long total = 0;
+    for (ThreadCache* tc = cacheRegistry.load(); tc; tc = tc->next) total += tc->bytes.load();
+    return total;
+}
+
+// fill this thread's caches for orders [lo, hi] to capacity, then wait. Every
+// thread allocates before any frees: a miss while a peer hoards would rob it.
+static void hoarder(int lo, int hi, ThreadCache** self, std::set<void*>* freed)
+{
+    std::vector<void*> p;
+    for (int order = lo; order <= hi; order++) {
+        size_t size = (MIN_BLOCK_SIZE << order) - sizeof(MallocMetadata);
+        for (size_t i = 0; i < CACHE_CAPACITY; i++) p.push_back(smalloc(size));
+    }
+    std::unique_lock<std::mutex> lk(lock);
+    allocated++;
+    cv.notify_all();
+    cv.wait(lk, [] { return allocated == threadsInRun; });
+    lk.unlock();
+    for (void* q : p) {
+        if (freed) freed->insert(q);
+        sfree(q);
+    }
+    lk.lock();
+    if (self) *self = threadCache.tc;
+    filled++;
+    cv.notify_all();
+    cv.wait(lk, [] { return release; });
+}
+
+static void wait_filled()
+{
+    std::unique_lock<std::mutex> lk(lock);
+    cv.wait(lk, [] { return filled == threadsInRun; });
+}
+
+static void let_go(std::vector<std::thread>& threads)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        release = true;
+    }
+    cv.notify_all();
+    for (auto& t : threads) t.join();
+    threads.clear();
+    allocated = filled = 0;
+    release = false;
+}
+
+int main()
+{
+    smalloc_set_cache_mode(SMALLOC_CACHE_PER_THREAD);
+    std::vector<std::thread> threads;
+
+    // stealing: misses probe STEAL_PROBES peers each, round-robin, so within a
+    // few refills the thief reaches the hoarder and takes its whole stack
+    ThreadCache* victim = nullptr;
+    std::set<void*> freed;
+    threadsInRun = 1;
+    threads.emplace_back(hoarder, 0, 0, &victim, &freed);
+    wait_filled();
+    assert(victim && victim->count[0].load() >= (long)CACHE_CAPACITY / 2);
+    std::thread thief([&] {
+        std::vector<void*> got;
+        bool stole = false;
+        for (int i = 0; i < 256 && !stole; i++) {
+            void* p = smalloc(64);
+            got.push_back(p);
+            stole = freed.count(p) != 0;
+        }
+        assert(stole && victim->count[0].load() == 0);
+        for (void* p : got) sfree(p);
+    });
+    thief.join();
+    let_go(threads);
+    smalloc_set_cache_mode(SMALLOC_CACHE_OFF);
+
+    // scavenge bound: 8 busy threads each caching 192KB (orders 4 and 5)
+    smalloc_set_cache_mode(SMALLOC_CACHE_PER_THREAD);
+    threadsInRun = 8;
+    for (int i = 0; i < 8; i++) threads.emplace_back(hoarder, 4, 5, nullptr, nullptr);
+    wait_filled();
+    assert(cached_bytes() > CACHE_TOTAL_LIMIT);
+    size_t blocks = _num_allocated_blocks();
+    cache_scavenge();   // first pass: every owner was active, so only the bound applies
+    assert(cached_bytes() > 0 && cached_bytes() <= CACHE_TOTAL_LIMIT);
+    cache_scavenge();   // nobody did anything since: every cache is drained
+    assert(cached_bytes() == 0);
+    // the drained blocks went back to buddyArray, where they merged
+    assert(_num_allocated_blocks() < blocks);
+    let_go(threads);
+    smalloc_set_cache_mode(SMALLOC_CACHE_OFF);
+    printf("cache_steal: ok\n");
+    return 0;
+}
@@ -0,0 +1,29 @@
+// Routing a size range to an engine and taking it out again leaves the fast
+// path on (enginesRouted off) when no other engine was ever configured.
+//   g++ -std=c++17 -O2 -pthread tests/engine_routing.cpp -o engine_routing
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+
+int main()
+{
+    sfree(smalloc(1));
+    assert(!enginesRouted.load());
+
+    smalloc_set_engine_range(SMALLOC_ENGINE_TLSF, 1000, 2000);
+    assert(enginesRouted.load());
+    void* p = smalloc(1500);
+    assert(p && engine_of((MallocMetadata*)((char*)p - sizeof(MallocMetadata))) ==
+                SMALLOC_ENGINE_TLSF);
+    sfree(p);
+
+    smalloc_set_engine_range(SMALLOC_ENGINE_TLSF, 1, 0);
+    assert(!enginesRouted.load());
+    p = smalloc(1500);
+    assert(p && engine_of((MallocMetadata*)((char*)p - sizeof(MallocMetadata))) ==
+                SMALLOC_ENGINE_BUDDY);
+    sfree(p);
+    printf("engine_routing: ok\n");
+    return 0;
+}
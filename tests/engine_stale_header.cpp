@@ -0,0 +1,56 @@
+// Memory that once held cached buddy blocks still carries their headers,
+// .prev = CACHED_MARK included. A non-buddy engine that later gets that top
+// block (tree or lock-free) must not let the stale mark make sfree drop its
+// blocks.
+//   g++ -std=c++17 -O2 -pthread tests/engine_stale_header.cpp -o engine_stale_header
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+
+static void stain_free_top_blocks()
+{
+    MallocMetadata* tops[NUM_INIT_BLOCKS];
+    int n = 0;
+    while (n < NUM_INIT_BLOCKS && (tops[n] = buddy_alloc_block(MAX_ORDER, true))) n++;
+    for (int i = 0; i < n; i++) {
+        for (size_t off = 0; off < BLOCK_SIZE; off += MIN_BLOCK_SIZE) {
+            MallocMetadata* old = (MallocMetadata*)((char*)tops[i] + off);
+            old->size    = MIN_BLOCK_SIZE;
+            old->is_free = false;
+            old->order   = 0;
+            old->next    = nullptr;
+            old->prev    = CACHED_MARK;
+        }
+        MallocMetadata* top = tops[i];
+        top->size  = BLOCK_SIZE;
+        top->order = MAX_ORDER;
+        buddy_free_block(top, true);
+    }
+}
+
+static void check_engine(SmallocEngine engine, const char* name)
+{
+    stain_free_top_blocks();
+    assert(smalloc_set_engine_range(engine, 1, 4096));
+    void* p[64];
+    for (int i = 0; i < 64; i++) {
+        p[i] = smalloc(64 + 61 * i);
+        assert(p[i] && engine_of((MallocMetadata*)((char*)p[i] - sizeof(MallocMetadata))) == engine);
+    }
+    for (int i = 0; i < 64; i++) sfree(p[i]);
+    if (engineLiveBytes.load() != 0) {
+        fprintf(stderr, "engine_stale_header: %s leaks %zu bytes\n", name, engineLiveBytes.load());
+        assert(false);
+    }
+    smalloc_set_engine_range(engine, 1, 0);
+}
+
+int main()
+{
+    sfree(smalloc(1));
+    check_engine(SMALLOC_ENGINE_TREE, "tree");
+    check_engine(SMALLOC_ENGINE_LOCKFREE, "lockfree");
+    printf("engine_stale_header: ok\n");
+    return 0;
+}
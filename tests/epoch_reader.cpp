@@ -0,0 +1,50 @@
+// A block retired with sfree_deferred while another thread is inside an epoch
+// stays allocated, payload untouched, however often the writer reclaims, and
+// is freed once that thread has left the epoch.
+//   g++ -std=c++17 -O2 -pthread tests/epoch_reader.cpp -o epoch_reader
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+#include <thread>
+
+static std::atomic<int> stage(0);
+
+static bool still_allocated(void* p)
+{
+    MallocMetadata* block = (MallocMetadata*)((char*)p - sizeof(MallocMetadata));
+    return !block->is_free && block->prev != CACHED_MARK;
+}
+
+int main()
+{
+    int* node = (int*)smalloc(sizeof(int) * 64);
+    assert(node);
+    for (int i = 0; i < 64; i++) node[i] = i;
+
+    std::thread reader([node] {
+        sepoch_enter();
+        stage.store(1);
+        while (stage.load() != 2) std::this_thread::yield();
+        for (int i = 0; i < 64; i++) assert(node[i] == i);
+        sepoch_exit();
+        stage.store(3);
+    });
+    while (stage.load() != 1) std::this_thread::yield();
+
+    sfree_deferred(node);
+    size_t freed = 0;
+    for (int i = 0; i < 1000; i++) freed += sepoch_reclaim();
+    // enough retires to trigger the batched collects as well
+    for (size_t i = 0; i < 4 * EPOCH_BATCH; i++) sfree_deferred(smalloc(16));
+    assert(freed == 0 && still_allocated(node));
+    assert(globalEpoch.load() <= 1);   // can't pass the reader's epoch
+
+    stage.store(2);
+    while (stage.load() != 3) std::this_thread::yield();
+    for (int i = 0; i < 3 && still_allocated(node); i++) sepoch_reclaim();
+    assert(!still_allocated(node));
+    reader.join();
+    printf("epoch_reader: ok\n");
+    return 0;
+}
@@ -0,0 +1,67 @@
+// Eight threads share the lock-free engine with a workload that makes it take
+// and give back arenas all the time. Every block is checked for its owner's
+// pattern before it's freed; the engine never holds more than LF_MAX_ARENAS
+// arenas and ends with just its spare.
+//   g++ -std=c++17 -O2 -pthread tests/lockfree_stress.cpp -o lockfree_stress
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+static const int THREADS = 8;
+static const int ROUNDS  = 50000;
+static const int SLOTS   = 24;
+
+static std::atomic<bool> corrupt(false);
+static std::atomic<int>  mostArenas(0);
+
+static void worker(int id)
+{
+    unsigned char* slot[SLOTS] = {};
+    size_t len[SLOTS] = {};
+    unsigned seed = 777u * (id + 1);
+    for (int r = 0; r < ROUNDS; r++) {
+        seed = seed * 1103515245u + 12345u;
+        int s = (seed >> 8) % SLOTS;
+        if (slot[s]) {
+            for (size_t i = 0; i < len[s]; i++) {
+                if (slot[s][i] != (unsigned char)id) corrupt.store(true);
+            }
+            sfree(slot[s]);
+            slot[s] = nullptr;
+        } else {
+            len[s] = 1 + (seed >> 12) % 30000;
+            slot[s] = (unsigned char*)smalloc(len[s]);
+            if (slot[s]) memset(slot[s], id, len[s]);
+        }
+        int held = __builtin_popcount(lfArenas.load());
+        int most = mostArenas.load();
+        while (held > most && !mostArenas.compare_exchange_weak(most, held)) {
+        }
+    }
+    for (int s = 0; s < SLOTS; s++) sfree(slot[s]);
+}
+
+int main()
+{
+    sfree(smalloc(1));
+    size_t freeBytes = _num_free_bytes();
+    smalloc_set_engine_range(SMALLOC_ENGINE_LOCKFREE, 1, 100000);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < THREADS; i++) threads.emplace_back(worker, i);
+    for (auto& t : threads) t.join();
+
+    assert(!corrupt.load());
+    assert(mostArenas.load() <= LF_MAX_ARENAS);
+    assert(engineLiveBytes.load() == 0);
+    int held = __builtin_popcount(lfArenas.load());
+    assert(held <= 1);
+    assert(_num_free_bytes() + held * (BLOCK_SIZE - sizeof(MallocMetadata)) == freeBytes);
+
+    smalloc_set_engine_range(SMALLOC_ENGINE_LOCKFREE, 1, 0);
+    printf("lockfree_stress: ok, at most %d arenas held\n", mostArenas.load());
+    return 0;
+}
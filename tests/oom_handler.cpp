@@ -0,0 +1,86 @@
+// Running out of buddy memory: the emergency reserve is handed back only
+// when nothing else helps, the OOM handler is retried for as long as it
+// reports that it released something (and not re-entered from inside), and
+// the reserve refills once memory is freed again.
+//   g++ -std=c++17 -O2 -pthread tests/oom_handler.cpp -o oom_handler
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+#include <set>
+#include <vector>
+
+static const size_t BIG = (MIN_BLOCK_SIZE << 9) - sizeof(MallocMetadata);   // 64KB blocks
+
+static std::vector<void*> held;
+static int  calls = 0;
+static int  uselessCalls = 0;   // calls that report a release without one
+static bool nestedFailed = false;
+
+static bool release_one(size_t)
+{
+    calls++;
+    if (calls == 1) {
+        // allocating from inside the handler must not call it again
+        nestedFailed = smalloc(BIG) == nullptr && calls == 1;
+    }
+    if (uselessCalls > 0) {
+        uselessCalls--;
+        return true;
+    }
+    if (held.empty()) return false;
+    sfree(held.back());
+    held.pop_back();
+    return true;
+}
+
+static bool release_nothing(size_t)
+{
+    calls++;
+    return false;
+}
+
+int main()
+{
+    sfree(smalloc(1));
+    bool reserved = smalloc_set_emergency_reserve(2);
+    assert(reserved && reserveCount == 2);
+    std::set<char*> reserve;
+    for (MallocMetadata* b = emergencyReserve; b; b = b->next) reserve.insert((char*)b);
+
+    // no handler: the heap is used up, then the reserve, then smalloc fails
+    size_t fromReserve = 0;
+    while (void* p = smalloc(BIG)) {
+        held.push_back(p);
+        if (reserve.count(arena_of((MallocMetadata*)((char*)p - sizeof(MallocMetadata))))) {
+            fromReserve++;
+        }
+    }
+    assert(fromReserve == 4 && reserveCount == 0);
+
+    // the handler frees one block per call; its own smalloc doesn't recurse
+    set_oom_handler(release_one);
+    void* p = smalloc(BIG);
+    assert(p && calls == 1 && nestedFailed);
+    held.push_back(p);
+
+    // retried while it says it released something
+    calls = 0;
+    uselessCalls = 2;
+    p = smalloc(BIG);
+    assert(p && calls == 3);
+    held.push_back(p);
+
+    // a handler that releases nothing is asked once
+    set_oom_handler(release_nothing);
+    calls = 0;
+    assert(smalloc(BIG) == nullptr && calls == 1);
+    set_oom_handler(nullptr);
+
+    // freeing refills the reserve
+    for (void* q : held) sfree(q);
+    held.clear();
+    assert(reserveCount == 2 && !reserveLow.load());
+    printf("oom_handler: ok\n");
+    return 0;
+}
@@ -0,0 +1,18 @@
+// The process exits with the parallel-fill workers still running; the
+// atexit handler has to stop them before their std::threads are destroyed
+// (which would otherwise call std::terminate).
+//   g++ -std=c++17 -O2 -pthread tests/parallel_fill_exit.cpp -o parallel_fill_exit
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+
+int main()
+{
+    smalloc_set_parallel_fill(1024 * 1024, 2);
+    char* p = (char*)scalloc(4, 1024 * 1024);
+    assert(p && p[0] == 0 && p[4 * 1024 * 1024 - 1] == 0);
+    sfree(p);
+    printf("parallel_fill_exit: ok\n");
+    return 0;   // workers deliberately left running
+}
@@ -0,0 +1,34 @@
+// With <sys/sdt.h> available the allocator's probes are compiled in and fire
+// where they should. tests/sdt has a stand-in header that counts them, since
+// the real one only emits notes for a tracer.
+//   g++ -std=c++17 -O2 -pthread -I tests/sdt tests/probes.cpp -o probes
+// test flags: -Isdt
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+#include <map>
+#include <string>
+
+static std::map<std::string, int> fired;
+
+void sdt_stub_fire(const char* provider, const char* name)
+{
+    assert(strcmp(provider, "smalloc") == 0);
+    fired[name]++;
+}
+
+int main()
+{
+    void* p = smalloc(100);           // splits top blocks down to order 1
+    assert(fired["smalloc"] == 1 && fired["split"] >= 1);
+    p = srealloc(p, 1000);            // a new block, the old one freed
+    assert(fired["srealloc"] == 1 && fired["sfree"] == 1);
+    sfree(p);                         // merges back up
+    assert(fired["sfree"] == 2 && fired["merge"] >= 1);
+    void* big = smalloc(BLOCK_SIZE * 2);
+    sfree(big);
+    assert(fired["mmap_alloc"] == 1 && fired["mmap_free"] == 1);
+    printf("probes: ok\n");
+    return 0;
+}
@@ -0,0 +1,20 @@
+// SMALLOC_NO_PROBES compiles the probes out even with <sys/sdt.h> on the
+// include path: the stand-in header's sdt_stub_fire is never defined here,
+// so this only links if no probe is left.
+//   g++ -std=c++17 -O2 -pthread -I tests/sdt tests/probes_off.cpp -o probes_off
+// test flags: -Isdt
+#define SMALLOC_NO_PROBES
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+
+int main()
+{
+    void* p = srealloc(smalloc(100), 1000);
+    assert(p);
+    sfree(p);
+    sfree(smalloc(BLOCK_SIZE * 2));
+    printf("probes_off: ok\n");
+    return 0;
+}
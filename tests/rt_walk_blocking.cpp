@@ -0,0 +1,48 @@
+// A heap walk whose callback blocks must not hold up a real-time thread: the
+// callback waits (up to two seconds) for the real-time thread to finish a
+// run of pool allocations, which it can only do if the walker isn't holding
+// the pool's lock.
+//   g++ -std=c++17 -O2 -pthread tests/rt_walk_blocking.cpp -o rt_walk_blocking
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+#include <thread>
+
+static std::atomic<bool> inCallback(false);
+static std::atomic<bool> rtDone(false);
+
+static bool wait_for_rt(const SheapBlockInfo*, void*)
+{
+    if (inCallback.exchange(true)) return true;
+    for (int i = 0; i < 2000 && !rtDone.load(); i++) usleep(1000);
+    return true;
+}
+
+int main()
+{
+    sfree(smalloc(1));
+    bool reserved = smalloc_rt_reserve(2);
+    assert(reserved);
+
+    std::thread rt([] {
+        smalloc_set_realtime(true);
+        while (!inCallback.load()) usleep(100);
+        for (int i = 0; i < 1000; i++) {
+            void* p = smalloc(64 + i % 4000);
+            assert(p);
+            sfree(p);
+        }
+        smalloc_set_realtime(false);
+        rtDone.store(true);
+    });
+    sheap_walk(wait_for_rt, nullptr);
+    bool finishedDuringWalk = rtDone.load();
+    rt.join();
+    assert(finishedDuringWalk);
+    assert(smalloc_rt_violations() == 0);
+    reserved = smalloc_rt_reserve(0);
+    assert(reserved);
+    printf("rt_walk_blocking: ok\n");
+    return 0;
+}
@@ -0,0 +1,80 @@
+// A real-time thread allocates and frees from its pool while another thread
+// keeps walking the heap and dumping its occupancy. Every walk has to cover
+// the whole region exactly; the real-time thread's worst-case latency is
+// printed for comparison.
+//   g++ -std=c++17 -O2 -pthread tests/rt_walk_stress.cpp -o rt_walk_stress
+#include "../forme.cpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+static const int ROUNDS = 200000;
+static const int SLOTS  = 32;
+
+static std::atomic<bool> done(false);
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void rt_worker(std::vector<uint32_t>* latency)
+{
+    smalloc_set_realtime(true);
+    void* slot[SLOTS] = {};
+    unsigned seed = 4242;
+    for (int r = 0; r < ROUNDS; r++) {
+        seed = seed * 1103515245u + 12345u;
+        int s = (seed >> 8) % SLOTS;
+        uint64_t t0 = now_ns();
+        if (slot[s]) {
+            sfree(slot[s]);
+            slot[s] = nullptr;
+        } else {
+            slot[s] = smalloc((size_t)64 << ((seed >> 16) % 8));
+        }
+        (*latency)[r] = (uint32_t)std::min<uint64_t>(now_ns() - t0, UINT32_MAX);
+    }
+    for (int s = 0; s < SLOTS; s++) sfree(slot[s]);
+    smalloc_set_realtime(false);
+    done.store(true);
+}
+
+static bool add_size(const SheapBlockInfo* info, void* ctx)
+{
+    if (info->state != SHEAP_MMAP) *(size_t*)ctx += info->size;
+    return true;
+}
+
+int main()
+{
+    sfree(smalloc(1));
+    bool reserved = smalloc_rt_reserve(4);
+    assert(reserved);
+
+    std::vector<uint32_t> latency(ROUNDS);
+    std::thread rt(rt_worker, &latency);
+    int walks = 0;
+    while (!done.load()) {
+        size_t covered = 0;
+        sheap_walk(add_size, &covered);
+        assert(covered == NUM_INIT_BLOCKS * BLOCK_SIZE);
+        bool dumped = sheap_dump_occupancy("/dev/null");
+        assert(dumped);
+        walks++;
+    }
+    rt.join();
+    assert(smalloc_rt_violations() == 0);
+    reserved = smalloc_rt_reserve(0);
+    assert(reserved);
+
+    std::sort(latency.begin(), latency.end());
+    printf("rt_walk_stress: ok, %d walks, latency p50 %uns p99 %uns max %uns\n", walks,
+           latency[ROUNDS / 2], latency[ROUNDS * 99 / 100], latency[ROUNDS - 1]);
+    return 0;
+}
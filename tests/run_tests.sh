@@ -0,0 +1,19 @@
+#!/bin/sh
+# Builds and runs every test under tests/. Each test includes ../forme.cpp
+# directly, so it can reach the allocator's internals. A "// test flags:" line
+# adds compiler flags for that test. The bench_* programs only run with BENCH=1.
+#   CXX=g++ sh tests/run_tests.sh
+set -e
+cd "$(dirname "$0")"
+CXX=${CXX:-g++}
+out=${TMPDIR:-/tmp}/smalloc-tests
+mkdir -p "$out"
+for src in *.cpp; do
+    name=${src%.cpp}
+    case $name in bench_*) [ -n "$BENCH" ] || continue ;; esac
+    std=c++17
+    grep -q 'std=c++20' "$src" && std=c++20
+    flags=$(sed -n 's|^// test flags: ||p' "$src")
+    $CXX -std=$std -O2 -pthread $flags "$src" -o "$out/$name"
+    "$out/$name"
+done
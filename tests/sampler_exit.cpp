@@ -0,0 +1,22 @@
+// The process exits with the stats sampler still running; the atexit
+// handler has to stop it before its std::thread is destroyed (which would
+// otherwise call std::terminate).
+//   g++ -std=c++17 -O2 -pthread tests/sampler_exit.cpp -o sampler_exit
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+
+int main()
+{
+    char path[] = "/tmp/smalloc-samplerXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    sfree(smalloc(100));
+    assert(smalloc_stats_start_sampler(path, 1, SMALLOC_STATS_JSON));
+    usleep(5000);
+    unlink(path);
+    printf("sampler_exit: ok\n");
+    return 0;   // sampler deliberately left running
+}
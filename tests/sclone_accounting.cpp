@@ -0,0 +1,45 @@
+// Copy-on-write blocks: the memfd bookkeeping isn't charged to the caller's
+// tag or to the budget, and sclone copies plain blocks correctly.
+//   g++ -std=c++17 -O2 -pthread tests/sclone_accounting.cpp -o sclone_accounting
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+
+static const size_t SIZE = 4 * 1024 * 1024;
+static const uint16_t TAG = 7;
+
+int main()
+{
+    sfree(smalloc(1));
+    smalloc_set_cow_mmap(true);
+    smalloc_set_tag(TAG);
+
+    char* a = (char*)smalloc(SIZE);
+    assert(a);
+    memset(a, 'a', SIZE);
+    assert(_num_tag_blocks(TAG) == 1);
+    assert(_num_tag_bytes(TAG) == SIZE);
+    assert(smalloc_budget_usage() == SIZE);
+
+    char* b = (char*)sclone(a);     // memfd-backed: no copy
+    assert(b && b[0] == 'a' && b[SIZE - 1] == 'a');
+    b[0] = 'b';
+    assert(a[0] == 'a');
+
+    char* c = (char*)sclone(b);     // plain now: copied into a new memfd
+    assert(c && c[0] == 'b' && c[SIZE - 1] == 'a');
+    assert(_num_tag_blocks(TAG) == 3);
+    assert(_num_tag_bytes(TAG) == 3 * SIZE);
+    assert(smalloc_budget_usage() == 3 * SIZE);
+
+    sfree(a);
+    sfree(b);
+    sfree(c);
+    assert(_num_tag_blocks(TAG) == 0);
+    assert(smalloc_budget_usage() == 0);
+    smalloc_set_tag(0);
+    smalloc_set_cow_mmap(false);
+    printf("sclone_accounting: ok\n");
+    return 0;
+}
@@ -0,0 +1,10 @@
+// Stand-in for systemtap's <sys/sdt.h>, for the probe tests only: each probe
+// calls sdt_stub_fire with its name instead of emitting a USDT note. A test
+// that expects the probes compiled out doesn't define sdt_stub_fire, so it
+// fails to link if any probe was left in.
+#pragma once
+
+void sdt_stub_fire(const char* provider, const char* name);
+
+#define DTRACE_PROBE2(provider, name, a, b)    sdt_stub_fire(#provider, #name)
+#define DTRACE_PROBE3(provider, name, a, b, c) sdt_stub_fire(#provider, #name)
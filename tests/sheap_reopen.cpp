@@ -0,0 +1,109 @@
+// A file-backed heap written by one process and reopened by another (this
+// program, re-executed) comes back with the same free lists, order by order
+// and offset by offset, and its data reachable from the root. Freeing
+// everything there merges the region back into whole top blocks.
+//   g++ -std=c++17 -O2 -pthread tests/sheap_reopen.cpp -o sheap_reopen
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/wait.h>
+#include <vector>
+
+static const int NODES = 40;
+
+struct Node {
+    uint64_t next;    // sheap_offset of the next node
+    int      id;
+};
+
+// every free block as (order, offset), in list order; the lists hold the
+// used blocks of their order too
+static std::vector<std::pair<int, uint64_t>> free_lists()
+{
+    std::vector<std::pair<int, uint64_t>> out;
+    for (int i = 0; i <= MAX_ORDER; i++) {
+        for (MallocMetadata* b = buddyArray[i].head; b; b = b->next) {
+            assert(b->order == i);
+            if (b->is_free) out.push_back({i, sheap_offset(b)});
+        }
+    }
+    return out;
+}
+
+static int reopen(const char* path, const char* savedPath)
+{
+    assert(sheap_open_file(path));
+    std::vector<std::pair<int, uint64_t>> saved;
+    FILE* f = fopen(savedPath, "rb");
+    assert(f);
+    std::pair<int, uint64_t> e;
+    while (fread(&e, sizeof(e), 1, f) == 1) saved.push_back(e);
+    fclose(f);
+    assert(!saved.empty() && free_lists() == saved);
+
+    std::vector<void*> nodes;
+    int id = 0;
+    for (Node* n = (Node*)sheap_get_root(); n; n = (Node*)sheap_pointer(n->next)) {
+        assert(n->id == id);
+        id += 2;
+        nodes.push_back(n);
+    }
+    assert((int)nodes.size() == NODES / 2);
+
+    // the freed holes are handed out again, smallest first
+    void* p = smalloc((MIN_BLOCK_SIZE << saved[0].first) - sizeof(MallocMetadata));
+    assert(sheap_offset((char*)p - sizeof(MallocMetadata)) == saved[0].second);
+    sfree(p);
+
+    for (void* n : nodes) sfree(n);
+    assert(buddyArray[MAX_ORDER].num_free_blocks == NUM_INIT_BLOCKS);
+    assert(_num_free_blocks() == NUM_INIT_BLOCKS);
+    printf("sheap_reopen: ok\n");
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc == 4 && strcmp(argv[1], "reopen") == 0) return reopen(argv[2], argv[3]);
+
+    char path[] = "/tmp/smalloc-heapXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    std::string savedPath = std::string(path) + ".saved";
+    assert(sheap_open_file(path));
+
+    // nodes of mixed orders, every other one freed to leave holes
+    Node* nodes[NODES];
+    for (int i = 0; i < NODES; i++) {
+        nodes[i] = (Node*)smalloc(sizeof(Node) + (i * 1531) % 6000);
+        assert(nodes[i]);
+        nodes[i]->id = i;
+    }
+    Node* prev = nullptr;
+    for (int i = NODES - 2; i >= 0; i -= 2) {
+        nodes[i]->next = sheap_offset(prev);
+        prev = nodes[i];
+    }
+    sheap_set_root(prev);
+    for (int i = 1; i < NODES; i += 2) sfree(nodes[i]);
+    assert(sheap_sync());
+
+    std::vector<std::pair<int, uint64_t>> lists = free_lists();
+    FILE* f = fopen(savedPath.c_str(), "wb");
+    assert(f && fwrite(lists.data(), sizeof(lists[0]), lists.size(), f) == lists.size());
+    fclose(f);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("/proc/self/exe", argv[0], "reopen", path, savedPath.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    unlink(path);
+    unlink(savedPath.c_str());
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+// Blocks of a shared heap cross the process boundary in both directions: a
+// forked child frees, through sfree and its own fresh mapping of the heap,
+// blocks its parent allocated, and allocates blocks the parent then frees.
+// Afterwards the heap has merged back into whole top blocks.
+//   g++ -std=c++17 -O2 -pthread tests/shm_fork.cpp -o shm_fork
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+#include <sys/wait.h>
+
+static const int N = 64;
+
+struct Table {
+    uint64_t fromParent[N];   // sshm_offset of the parent's blocks
+    uint64_t fromChild[N];
+};
+
+static int child(int fd, uint64_t tableOff)
+{
+    // a second mapping, maybe elsewhere: offsets are all the child trusts
+    SharedHeap* h = sshm_attach_fd(fd);
+    if (!h) return 1;
+    Table* t = (Table*)sshm_pointer(h, tableOff);
+    for (int i = 0; i < N; i++) {
+        char* p = (char*)sshm_pointer(h, t->fromParent[i]);
+        if (p[0] != (char)i) return 2;
+        sfree(p);
+    }
+    for (int i = 0; i < N; i++) {
+        char* p = (char*)sshm_alloc(h, 50 + i * 37);
+        if (!p) return 3;
+        memset(p, 'A' + i % 26, 50 + i * 37);
+        t->fromChild[i] = sshm_offset(h, p);
+    }
+    return 0;
+}
+
+int main()
+{
+    SharedHeap* h = sshm_create(nullptr, 8 * BLOCK_SIZE);
+    assert(h);
+    Table* t = (Table*)sshm_alloc(h, sizeof(Table));
+    assert(t);
+    for (int i = 0; i < N; i++) {
+        char* p = (char*)sshm_alloc(h, 100 + i * 61);
+        assert(p);
+        p[0] = (char)i;
+        t->fromParent[i] = sshm_offset(h, p);
+    }
+    assert(h->hdr->usedBlocks == N + 1);
+
+    int fd = dup(sshm_fd(h));
+    assert(fd >= 0);
+    uint64_t tableOff = sshm_offset(h, t);
+    pid_t pid = fork();
+    if (pid == 0) {
+        sshm_detach(h);
+        _exit(child(fd, tableOff));
+    }
+    close(fd);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    assert(h->hdr->usedBlocks == N + 1);
+    for (int i = 0; i < N; i++) {
+        char* p = (char*)sshm_pointer(h, t->fromChild[i]);
+        for (int j = 0; j < 50 + i * 37; j++) assert(p[j] == 'A' + i % 26);
+        sfree(p);
+    }
+    sfree(t);
+    assert(h->hdr->usedBlocks == 0 && h->hdr->usedBytes == 0);
+    assert(h->hdr->freeBlocks[MAX_ORDER] == 8);
+    sshm_detach(h);
+    printf("shm_fork: ok\n");
+    return 0;
+}
@@ -0,0 +1,77 @@
+// sio_alloc buffers are page aligned whatever their size, a freed buffer is
+// the next one handed out in its size class, and sio_pool_trim gives back
+// exactly the slabs with no buffer in use.
+//   g++ -std=c++17 -O2 -pthread tests/sio_pool.cpp -o sio_pool
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+#include <vector>
+
+static size_t free_top_blocks()
+{
+    return buddyArray[MAX_ORDER].num_free_blocks;
+}
+
+int main()
+{
+    void* warm = smalloc(1);   // sets up the region
+    sfree(warm);
+    size_t baseline = free_top_blocks();
+
+    // alignment, for every class and for the mmap'd large buffers
+    const size_t sizes[] = {1, 100, IO_PAGE - 1, IO_PAGE, IO_PAGE + 1, 3 * IO_PAGE,
+                            8 * IO_PAGE, 16 * IO_PAGE, 16 * IO_PAGE + 1, 300000};
+    std::vector<void*> bufs;
+    for (size_t size : sizes) {
+        char* p = (char*)sio_alloc(size);
+        assert(p && (uintptr_t)p % IO_PAGE == 0);
+        memset(p, 0x5a, size);
+        bufs.push_back(p);
+    }
+    for (void* p : bufs) sio_free(p);
+    assert(sio_pool_trim() > 0);
+    assert(free_top_blocks() == baseline);
+
+    // recycling: the last buffer freed in a class is the next one out
+    void* a = sio_alloc(2 * IO_PAGE);
+    void* b = sio_alloc(2 * IO_PAGE);
+    assert(a && b && a != b);
+    sio_free(a);
+    assert(sio_alloc(2 * IO_PAGE) == a);
+    sio_free(b);
+    sio_free(b);                      // a second free is ignored
+    assert(sio_alloc(2 * IO_PAGE) == b);
+    void* c = sio_alloc(2 * IO_PAGE);
+    assert(c != a && c != b);
+    sio_free(a);
+    sio_free(b);
+    sio_free(c);
+
+    // trim: fill two slabs with one-page buffers, keep one buffer busy
+    std::vector<void*> pages;
+    for (int i = 0; i < 2 * (IO_SLAB_PAGES - 1); i++) {
+        pages.push_back(sio_alloc(IO_PAGE));
+        assert(pages.back());
+    }
+    size_t inUse = baseline - free_top_blocks();
+    assert(inUse >= 2);
+    void* keep = pages[0];
+    for (size_t i = 1; i < pages.size(); i++) sio_free(pages[i]);
+    size_t released = sio_pool_trim();
+    assert(released == (inUse - 1) * BLOCK_SIZE);
+    assert(free_top_blocks() == baseline - 1);
+    assert(sio_pool_trim() == 0);     // nothing more to give back
+
+    // the kept slab still recycles, and goes once its last buffer does
+    void* other = sio_alloc(IO_PAGE);
+    assert(other && other != keep);
+    sio_free(other);
+    sio_free(keep);
+    assert(sio_alloc(IO_PAGE) == keep);
+    sio_free(keep);
+    sio_pool_trim();
+    assert(free_top_blocks() == baseline);
+    printf("sio_pool: ok\n");
+    return 0;
+}
@@ -0,0 +1,63 @@
+// smap_file hands out the file's bytes; srealloc mremaps them and sfree
+// unmaps them. The out-of-band record isn't tagged or charged: the budget
+// and the mmap stats see exactly the mapped length, so a hard limit of
+// exactly that much still admits the mapping.
+//   g++ -std=c++17 -O2 -pthread tests/smap_file.cpp -o smap_file
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+
+int main()
+{
+    char path[] = "/tmp/smalloc-smapXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+    const size_t len = 3 * 4096 + 100;
+    assert(ftruncate(fd, 5 * 4096) == 0);
+    for (size_t i = 0; i < 5 * 4096; i += 4096) {
+        char c = (char)('a' + i / 4096);
+        assert(pwrite(fd, &c, 1, i) == 1);
+    }
+
+    sfree(smalloc(1));
+    size_t usage0  = smalloc_budget_usage();
+    size_t blocks0 = _num_allocated_blocks();
+    smalloc_set_limits(0, usage0 + len);
+    uint16_t old = smalloc_set_tag(7);
+    char* p = (char*)smap_file(fd, 0, len, SMAP_WRITABLE | SMAP_SHARED);
+    smalloc_set_tag(old);
+    assert(p && page_aligned(p));
+    assert(smalloc_budget_usage() == usage0 + len);
+    assert(_num_allocated_blocks() == blocks0 + 1);
+    assert(_num_tag_bytes(7) == 0 && _num_tag_blocks(7) == 0);
+    assert(p[0] == 'a' && p[4096] == 'b' && p[8192] == 'c');
+
+    // shared: writes reach the file
+    p[1] = 'X';
+    char c = 0;
+    assert(pread(fd, &c, 1, 1) == 1 && c == 'X');
+
+    // growing mremaps; the contents stay and the file's later pages show up
+    smalloc_set_limits(0, 0);
+    p = (char*)srealloc(p, 5 * 4096);
+    assert(p && p[1] == 'X' && p[4 * 4096] == 'e');
+    assert(smalloc_budget_usage() == usage0 + 5 * 4096);
+    p = (char*)srealloc(p, 4096);
+    assert(p && p[0] == 'a' && smalloc_budget_usage() == usage0 + 4096);
+
+    sfree(p);
+    assert(smalloc_budget_usage() == usage0);
+    assert(_num_allocated_blocks() == blocks0);
+    assert(fileMapCount.load() == 0);
+
+    // the record is reused, not leaked
+    p = (char*)smap_file(fd, 4096, 100, 0);
+    assert(p && p[0] == 'b');
+    sfree(p);
+    assert(smalloc_budget_usage() == usage0);
+    close(fd);
+    printf("smap_file: ok\n");
+    return 0;
+}
@@ -0,0 +1,108 @@
+// A snapshot taken while blocks are out from the real-time pool, from a
+// cache and under a tag is restored in a fresh process (this program,
+// re-executed), and freeing those blocks there leaves the stats, the budget
+// and the tag counters where they were before they were allocated.
+//   g++ -std=c++17 -O2 -pthread tests/snapshot_restore.cpp -o snapshot_restore
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/wait.h>
+
+struct Saved {
+    void*  rt;
+    void*  cached;
+    void*  tagged;
+    size_t allocatedBlocks;   // before any of the three was allocated
+    size_t freeBlocks;
+    size_t usage;
+    size_t snapBlocks;        // at snapshot time
+    size_t snapUsage;
+};
+
+static int restore(const char* path, const char* savedPath)
+{
+    if (!sheap_restore(path)) {
+        fprintf(stderr, "snapshot_restore: restore failed (address range taken?)\n");
+        return 1;
+    }
+    Saved s;
+    FILE* f = fopen(savedPath, "rb");
+    assert(f && fread(&s, sizeof(s), 1, f) == 1);
+    fclose(f);
+    assert(strcmp((char*)s.rt, "rt") == 0 && strcmp((char*)s.cached, "cached") == 0);
+    assert(_num_tag_bytes(5) != 0);
+    assert(_num_allocated_blocks() == s.snapBlocks && smalloc_budget_usage() == s.snapUsage);
+
+    // pool blocks are outside the stats, so this must not touch them
+    sfree(s.rt);
+    assert(_num_allocated_blocks() == s.snapBlocks && smalloc_budget_usage() == s.snapUsage);
+    sfree(s.cached);
+    sfree(s.tagged);
+    assert(_num_tag_bytes(5) == 0 && _num_tag_blocks(5) == 0);
+    assert(smalloc_budget_usage() == s.usage);
+    assert(_num_allocated_blocks() == s.allocatedBlocks);
+    assert(_num_free_blocks() == s.freeBlocks);
+
+    // the pool survived whole: it can be handed back to buddyArray
+    assert(smalloc_rt_reserve(0));
+    void* p = smalloc(100);
+    assert(p);
+    sfree(p);
+    printf("snapshot_restore: ok\n");
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc == 4 && strcmp(argv[1], "restore") == 0) return restore(argv[2], argv[3]);
+
+    char path[] = "/tmp/smalloc-snapXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    std::string savedPath = std::string(path) + ".saved";
+
+    assert(smalloc_rt_reserve(2));
+    Saved s;
+    s.allocatedBlocks = _num_allocated_blocks();
+    s.freeBlocks      = _num_free_blocks();
+    s.usage           = smalloc_budget_usage();
+
+    smalloc_set_realtime(true);
+    s.rt = smalloc(100);
+    smalloc_set_realtime(false);
+    assert(s.rt && rt_owns((MallocMetadata*)((char*)s.rt - sizeof(MallocMetadata))));
+    strcpy((char*)s.rt, "rt");
+
+    smalloc_set_cache_mode(SMALLOC_CACHE_PER_THREAD);
+    s.cached = smalloc(100);
+    assert(s.cached &&
+           ((MallocMetadata*)((char*)s.cached - sizeof(MallocMetadata)))->prev == CACHE_LIVE_MARK);
+    strcpy((char*)s.cached, "cached");
+
+    uint16_t old = smalloc_set_tag(5);
+    s.tagged = smalloc(3000);
+    smalloc_set_tag(old);
+    assert(s.tagged);
+
+    assert(sheap_snapshot(path));
+    s.snapBlocks = _num_allocated_blocks();
+    s.snapUsage  = smalloc_budget_usage();
+    FILE* f = fopen(savedPath.c_str(), "wb");
+    assert(f && fwrite(&s, sizeof(s), 1, f) == 1);
+    fclose(f);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("/proc/self/exe", argv[0], "restore", path, savedPath.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    unlink(path);
+    unlink(savedPath.c_str());
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : 1;
+}
@@ -0,0 +1,82 @@
+// A ring's bytes read straight across its end (both views are the same
+// pages), the heap walker reports it and the other mmapList kinds with their
+// real order, and sfree unmaps the header page and both views.
+//   g++ -std=c++17 -O2 -pthread tests/sring.cpp -o sring
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+
+static bool mapped(const void* p)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    void* start = (void*)((uintptr_t)p & ~(uintptr_t)(page - 1));
+    return msync(start, page, MS_ASYNC) == 0 || errno != ENOMEM;
+}
+
+struct Kinds {
+    int plain, ring, file, cow, io;
+};
+
+static bool count_kind(const SheapBlockInfo* info, void* ctx)
+{
+    Kinds* k = (Kinds*)ctx;
+    if (info->state != SHEAP_MMAP) return true;
+    switch (info->order) {
+    case -1:         k->plain++; break;
+    case RING_ORDER: k->ring++;  break;
+    case FILE_ORDER: k->file++;  break;
+    case COW_ORDER:  k->cow++;   break;
+    case IO_ORDER:   k->io++;    break;
+    default:         assert(false);
+    }
+    return true;
+}
+
+int main()
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char* ring = (char*)sring_alloc(3 * page - 10);
+    assert(ring);
+    size_t size = 3 * page;
+
+    // a message written across the end reads back contiguously
+    const char msg[] = "wraps around the end";
+    size_t at = size - 7;
+    for (size_t i = 0; i < sizeof(msg); i++) ring[(at + i) % size] = msg[i];
+    assert(memcmp(ring + at, msg, sizeof(msg)) == 0);
+    ring[size + 5] = 'Z';
+    assert(ring[5] == 'Z');
+
+    void* plain = smalloc(BLOCK_SIZE * 2);
+    smalloc_set_cow_mmap(true);
+    void* cow = smalloc(BLOCK_SIZE * 2);
+    smalloc_set_cow_mmap(false);
+    void* io = sio_alloc(IO_PAGE << IO_CLASSES);
+    int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+    assert(fd >= 0);
+    void* file = smap_file(fd, 0, 100, 0);
+    close(fd);
+    assert(plain && cow && io && file);
+
+    Kinds k = {};
+    sheap_walk(count_kind, &k);
+    assert(k.plain == 1 && k.ring == 1 && k.file == 1 && k.cow == 1 && k.io == 1);
+
+    size_t blocks = _num_allocated_blocks();
+    sfree(ring);
+    assert(_num_allocated_blocks() == blocks - 1);
+    assert(!mapped(ring - page) && !mapped(ring) && !mapped(ring + size) &&
+           !mapped(ring + 2 * size - 1));
+
+    sfree(plain);
+    sfree(cow);
+    sio_free(io);
+    sfree(file);
+    k = Kinds();
+    sheap_walk(count_kind, &k);
+    assert(k.plain + k.ring + k.file + k.cow + k.io == 0);
+    printf("sring: ok\n");
+    return 0;
+}
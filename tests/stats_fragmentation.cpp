@@ -0,0 +1,41 @@
+// The exported fragmentation ratio: 0 on a fresh heap, near 1 once every
+// other smallest block is in use.
+//   g++ -std=c++17 -O2 -pthread tests/stats_fragmentation.cpp -o stats_fragmentation
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+static const size_t SMALLEST = MIN_BLOCK_SIZE - sizeof(MallocMetadata);
+static const size_t MAX_PTRS = NUM_INIT_BLOCKS * BLOCK_SIZE / MIN_BLOCK_SIZE;
+
+static void* ptrs[MAX_PTRS];
+
+static double fragmentation()
+{
+    StatsSnapshot snap;
+    take_stats_snapshot(&snap);
+    return snap.fragmentation;
+}
+
+int main()
+{
+    sfree(smalloc(1));
+    assert(fragmentation() == 0.0);
+
+    char json[4096];
+    smalloc_stats_export(SMALLOC_STATS_JSON, json, sizeof(json));
+    assert(strstr(json, "\"fragmentation\":0.0000"));
+
+    size_t n = 0;
+    while (n < MAX_PTRS && (ptrs[n] = smalloc(SMALLEST))) n++;
+    for (size_t i = 0; i < n; i += 2) sfree(ptrs[i]);
+    double checkerboard = fragmentation();
+    assert(checkerboard > 0.99);
+
+    for (size_t i = 1; i < n; i += 2) sfree(ptrs[i]);
+    assert(fragmentation() == 0.0);
+    printf("stats_fragmentation: ok (checkerboard %.4f)\n", checkerboard);
+    return 0;
+}
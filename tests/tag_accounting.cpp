@@ -0,0 +1,66 @@
+// Per-tag live bytes and blocks follow a block through smalloc, srealloc
+// (which keeps the tag, across buddy and mmap blocks) and sfree; tags are
+// per thread, smalloc_tagged overrides them, and out-of-range tags count as
+// untagged.
+//   g++ -std=c++17 -O2 -pthread tests/tag_accounting.cpp -o tag_accounting
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+#include <thread>
+
+static size_t payload(void* p)
+{
+    MallocMetadata* block = (MallocMetadata*)((char*)p - sizeof(MallocMetadata));
+    return block->size - sizeof(MallocMetadata);
+}
+
+int main()
+{
+    uint16_t old = smalloc_set_tag(3);
+    void* a = smalloc(100);
+    void* b = smalloc(5000);
+    smalloc_set_tag(old);
+    void* untagged = smalloc(100);
+    assert(a && b && untagged);
+    assert(_num_tag_blocks(3) == 2 && _num_tag_bytes(3) == payload(a) + payload(b));
+
+    // srealloc keeps the tag: buddy -> bigger buddy -> mmap -> bigger mmap
+    a = srealloc(a, 3000);
+    assert(_num_tag_blocks(3) == 2 && _num_tag_bytes(3) == payload(a) + payload(b));
+    a = srealloc(a, 300000);
+    assert(((MallocMetadata*)((char*)a - sizeof(MallocMetadata)))->is_mmap);
+    assert(_num_tag_blocks(3) == 2 && _num_tag_bytes(3) == payload(a) + payload(b));
+    a = srealloc(a, 600000);
+    assert(_num_tag_blocks(3) == 2 && _num_tag_bytes(3) == payload(a) + payload(b));
+
+    // smalloc_tagged wins over the thread's tag; tags past MAX_TAGS are untagged
+    old = smalloc_set_tag(3);
+    void* c = smalloc_tagged(200, 4);
+    void* d = smalloc_tagged(200, MAX_TAGS + 1);
+    smalloc_set_tag(old);
+    assert(_num_tag_blocks(4) == 1 && _num_tag_bytes(4) == payload(c));
+    assert(_num_tag_blocks(3) == 2);
+
+    // another thread's tag doesn't leak into this one
+    void* e = nullptr;
+    std::thread t([&] {
+        smalloc_set_tag(9);
+        e = smalloc(1000);
+    });
+    t.join();
+    assert(_num_tag_blocks(9) == 1 && _num_tag_bytes(9) == payload(e));
+    void* f = smalloc(1000);
+    assert(_num_tag_blocks(9) == 1);
+
+    size_t snap[10];
+    assert(_tag_snapshot(snap, 10) == 10);
+    assert(snap[0] == 0 && snap[3] == _num_tag_bytes(3) && snap[9] == payload(e));
+
+    for (void* p : { a, b, c, d, e, f, untagged }) sfree(p);
+    for (uint16_t tag : { 3, 4, 9 }) {
+        assert(_num_tag_bytes(tag) == 0 && _num_tag_blocks(tag) == 0);
+    }
+    printf("tag_accounting: ok\n");
+    return 0;
+}
@@ -0,0 +1,54 @@
+// Frees that run at thread exit after the thread's cache record was given
+// back (the epoch record's collect, or a user thread_local destroyed later)
+// must neither claim a new record that nobody returns nor push onto the
+// record just given back; the blocks go straight back to buddyArray.
+//   g++ -std=c++17 -O2 -pthread tests/thread_exit_free.cpp -o thread_exit_free
+#include "../forme.cpp"
+
+#include <cassert>
+#include <cstdio>
+#include <thread>
+
+struct Holder {
+    void* p[8];
+    ~Holder()
+    {
+        for (void* q : p) sfree(q);
+    }
+};
+
+static size_t records_in_use()
+{
+    size_t n = 0;
+    for (ThreadCache* tc = cacheRegistry.load(); tc; tc = tc->next) {
+        if (tc->in_use.load()) n++;
+        else assert(tc->bytes.load() == 0);   // nobody may push onto a free record
+    }
+    return n;
+}
+
+static void worker()
+{
+    // constructed before this thread's first smalloc => destroyed after its cache
+    static thread_local Holder holder = {};
+    for (void*& q : holder.p) q = smalloc(200);
+    for (int i = 0; i < 40; i++) sfree_deferred(smalloc(200));
+    globalEpoch.fetch_add(2);   // as if time passed: all of it is safe at exit
+}
+
+int main()
+{
+    sfree(smalloc(1));
+    size_t freeBytes = _num_free_bytes();
+    smalloc_set_cache_mode(SMALLOC_CACHE_PER_THREAD);
+    sfree(smalloc(200));   // the main thread's own record
+    size_t inUse = records_in_use();
+
+    for (int round = 0; round < 4; round++) std::thread(worker).join();
+
+    assert(records_in_use() == inUse);
+    smalloc_set_cache_mode(SMALLOC_CACHE_OFF);
+    assert(_num_free_bytes() == freeBytes);
+    printf("thread_exit_free: ok\n");
+    return 0;
+}